@@ -0,0 +1,642 @@
+//
+//  main.cpp
+//  Bench
+//
+//  Name - Michael Bottone
+//  Advanced Distributed Systems - Fall 2015
+//
+
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <cmath>
+#include <random>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// ** Global Types and Properties
+
+// Phase times of one finished transaction, in microseconds
+struct LatencyRecord
+{
+    bool committed;
+    uint64_t start;
+    uint64_t prepare;
+    uint64_t log;
+    uint64_t decision;
+};
+
+// A started node, with the pipe its stdin reads from
+struct Node
+{
+    string name;
+    string directory;
+    pid_t pid;
+    int input;
+};
+
+// ** Global Functions **
+
+// Split string by a delimeter into a vector of tokens
+vector<string> split(string fullString, char delimiter)
+{
+    vector<string> splits;
+    stringstream stream(fullString);
+    string token;
+    
+    while(getline(stream, token, delimiter))
+    {
+        splits.push_back(token);
+    }
+    
+    return splits;
+}
+
+// Nanoseconds on the monotonic clock
+uint64_t monotonicTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Generates a booking workload, runs the coordinator and participants
+// against it on loopback, and reports throughput and per phase latency
+// from the coordinator's latency log as JSON
+class Benchmark
+{
+private:
+    
+    // ** Class Parameters **
+    
+    string configFile;
+    
+    // Workload
+    int requests = 10000;
+    int tickets = 2;
+    int dates = 3;
+    int span = 30;
+    double conflict = 0.05;
+    int capacity = 100000;
+    int participantCount = 2;
+    int seed = 1;
+    
+    // Settings passed on to the nodes
+    int window = 64;
+    int batch = 16;
+    int linger = 1;
+    int groupCommit = 0;
+    string protocol = "standard";
+    int shards = 0;
+    
+    int basePort = 7100;
+    int timeout = 120;
+    string runDirectory = "bench-run";
+    string coordinatorBinary = "./coordinator";
+    string participantBinary = "./participant";
+    
+    vector<Node> participants;
+    Node coordinator;
+    double elapsed = 0;
+    
+    // ** Private Functions **
+    
+    // Read lines from a given file
+    vector<string> readFile(string filename)
+    {
+        ifstream readFile (filename);
+        string line;
+        vector<string> lines;
+        if (readFile.is_open())
+        {
+            while (getline(readFile, line))
+            {
+                if (!line.empty() && line[line.length() - 1] == '\r')
+                {
+                    line.erase(line.length() - 1, 1);
+                }
+                lines.push_back(line);
+            }
+            readFile.close();
+        }
+        else
+        {
+            cout << "Error - Could not open " << filename << endl;
+            exit(1);
+        }
+        
+        return lines;
+    }
+    
+    // Every line is an optional "name value" setting
+    void readConfigFile()
+    {
+        vector<string> lines = readFile(configFile);
+        for (int i = 0;i < lines.size();i ++)
+        {
+            vector<string> option = split(lines[i], ' ');
+            if (option.size() < 2)
+            {
+                continue;
+            }
+            
+            if (option[0] == "requests")
+            {
+                requests = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "tickets")
+            {
+                tickets = max(0, stoi(option[1]));
+            }
+            else if (option[0] == "dates")
+            {
+                dates = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "span")
+            {
+                span = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "conflict")
+            {
+                conflict = min(1.0, max(0.0, stod(option[1])));
+            }
+            else if (option[0] == "capacity")
+            {
+                capacity = max(0, stoi(option[1]));
+            }
+            else if (option[0] == "participants")
+            {
+                participantCount = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "seed")
+            {
+                seed = stoi(option[1]);
+            }
+            else if (option[0] == "window")
+            {
+                window = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "batch")
+            {
+                batch = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "linger")
+            {
+                linger = max(0, stoi(option[1]));
+            }
+            else if (option[0] == "group_commit")
+            {
+                groupCommit = max(0, stoi(option[1]));
+            }
+            else if (option[0] == "protocol")
+            {
+                protocol = option[1];
+            }
+            else if (option[0] == "shards")
+            {
+                shards = max(0, stoi(option[1]));
+            }
+            else if (option[0] == "port")
+            {
+                basePort = stoi(option[1]);
+            }
+            else if (option[0] == "timeout")
+            {
+                timeout = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "run_dir")
+            {
+                runDirectory = option[1];
+            }
+            else if (option[0] == "coordinator_binary")
+            {
+                coordinatorBinary = option[1];
+            }
+            else if (option[0] == "participant_binary")
+            {
+                participantBinary = option[1];
+            }
+        }
+        
+        dates = min(dates, span);
+    }
+    
+    // Create a directory, or empty it if it is left from an earlier run
+    void prepareDirectory(string path)
+    {
+        if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST)
+        {
+            cout << "Error - Could not create " << path << endl;
+            exit(1);
+        }
+        
+        DIR * directory = opendir(path.c_str());
+        if (directory == NULL)
+        {
+            cout << "Error - Could not open " << path << endl;
+            exit(1);
+        }
+        
+        dirent * entry;
+        while ((entry = readdir(directory)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            {
+                unlink((path + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(directory);
+    }
+    
+    void writeFile(string filename, string contents)
+    {
+        ofstream file(filename, ios::trunc);
+        file << contents;
+        file.close();
+        
+        if (file.fail())
+        {
+            cout << "Error - Could not write " << filename << endl;
+            exit(1);
+        }
+    }
+    
+    string participantName(int i)
+    {
+        return "p" + to_string(i + 1);
+    }
+    
+    // Conflicting bookings all ask for the first dates of the span, the
+    // rest for a stay starting anywhere after them
+    void writeBookings(string filename)
+    {
+        mt19937 random(seed);
+        uniform_real_distribution<double> chance(0.0, 1.0);
+        uniform_int_distribution<int> ticketCount(min(1, tickets), tickets);
+        uniform_int_distribution<int> firstDate(min(dates + 1, span - dates + 1), span - dates + 1);
+        
+        ofstream file(filename, ios::trunc);
+        for (int i = 0;i < requests;i ++)
+        {
+            int first = (chance(random) < conflict ? 1 : firstDate(random));
+            
+            file << i + 1 << " " << ticketCount(random) << " [";
+            for (int d = 0;d < dates;d ++)
+            {
+                file << (d > 0 ? " " : "") << first + d;
+            }
+            file << "]\n";
+        }
+        file.close();
+        
+        if (file.fail())
+        {
+            cout << "Error - Could not write " << filename << endl;
+            exit(1);
+        }
+    }
+    
+    void writeConfigs()
+    {
+        prepareDirectory(runDirectory);
+        
+        string coordinatorConfig = "bookings.txt\n";
+        for (int i = 0;i < participantCount;i ++)
+        {
+            string name = participantName(i);
+            string address = "127.0.0.1:" + to_string(basePort + i);
+            coordinatorConfig += "participant " + name + " " + address + "\n";
+            
+            string config = address + "\nname " + name + "\n";
+            if (shards > 0)
+            {
+                config += "shards " + to_string(shards) + "\n";
+            }
+            for (int date = 1;date <= span;date ++)
+            {
+                config += to_string(date) + " " + to_string(capacity) + "\n";
+            }
+            
+            string directory = runDirectory + "/" + name;
+            prepareDirectory(directory);
+            writeFile(directory + "/config.txt", config);
+        }
+        
+        coordinatorConfig += "window " + to_string(window) + "\n";
+        coordinatorConfig += "batch " + to_string(batch) + "\n";
+        coordinatorConfig += "linger " + to_string(linger) + "\n";
+        coordinatorConfig += "group_commit " + to_string(groupCommit) + "\n";
+        coordinatorConfig += "protocol " + protocol + "\n";
+        coordinatorConfig += "latency_log latency.txt\n";
+        
+        string directory = runDirectory + "/coordinator";
+        prepareDirectory(directory);
+        writeFile(directory + "/config.txt", coordinatorConfig);
+        writeBookings(directory + "/bookings.txt");
+    }
+    
+    // Start a node in its own directory, with its output in stdout.txt and
+    // stdin left open so it waits for commands instead of reading EOF
+    Node startNode(string name, string binary)
+    {
+        char path[PATH_MAX];
+        if (realpath(binary.c_str(), path) == NULL)
+        {
+            cout << "Error - Could not find " << binary << endl;
+            exit(1);
+        }
+        
+        Node node;
+        node.name = name;
+        node.directory = runDirectory + "/" + name;
+        
+        int input[2];
+        if (pipe(input) == -1)
+        {
+            cout << "Error creating pipe for " << name << endl;
+            exit(1);
+        }
+        
+        node.pid = fork();
+        if (node.pid == -1)
+        {
+            cout << "Error starting " << name << endl;
+            exit(1);
+        }
+        
+        if (node.pid == 0)
+        {
+            int output = open((node.directory + "/stdout.txt").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (chdir(node.directory.c_str()) == -1 || output == -1)
+            {
+                _exit(1);
+            }
+            
+            dup2(input[0], STDIN_FILENO);
+            dup2(output, STDOUT_FILENO);
+            dup2(output, STDERR_FILENO);
+            close(input[0]);
+            close(input[1]);
+            close(output);
+            
+            execl(path, path, "config.txt", (char *) NULL);
+            _exit(1);
+        }
+        
+        close(input[0]);
+        node.input = input[1];
+        return node;
+    }
+    
+    // Whether something is listening on the loopback port, from /proc
+    bool isListening(int port)
+    {
+        char local[32];
+        snprintf(local, sizeof(local), "0100007F:%04X", port);
+        
+        vector<string> lines = readFile("/proc/net/tcp");
+        for (int i = 1;i < lines.size();i ++)
+        {
+            istringstream fields(lines[i]);
+            string slot, localAddress, remoteAddress, state;
+            fields >> slot >> localAddress >> remoteAddress >> state;
+            if (localAddress == local && state == "0A")
+            {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    // Wait for a node to exit, killing it after timeoutMs. True if it
+    // exited with status 0.
+    bool waitForNode(Node & node, int timeoutMs)
+    {
+        uint64_t deadline = monotonicTime() + (uint64_t) timeoutMs * 1000000;
+        int status = 0;
+        while (waitpid(node.pid, &status, WNOHANG) == 0)
+        {
+            if (monotonicTime() >= deadline)
+            {
+                cout << "Error - " << node.name << " did not finish, see " << node.directory << "/stdout.txt" << endl;
+                kill(node.pid, SIGKILL);
+                waitpid(node.pid, &status, 0);
+                close(node.input);
+                return false;
+            }
+            usleep(10000);
+        }
+        
+        close(node.input);
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    
+    void stopAll()
+    {
+        for (int i = 0;i < participants.size();i ++)
+        {
+            kill(participants[i].pid, SIGKILL);
+            waitpid(participants[i].pid, NULL, 0);
+        }
+    }
+    
+    bool runNodes()
+    {
+        for (int i = 0;i < participantCount;i ++)
+        {
+            participants.push_back(startNode(participantName(i), participantBinary));
+        }
+        
+        // The coordinator gives up if a participant is not listening yet
+        uint64_t deadline = monotonicTime() + 10000000000ULL;
+        for (int i = 0;i < participantCount;i ++)
+        {
+            while (!isListening(basePort + i))
+            {
+                if (monotonicTime() >= deadline)
+                {
+                    cout << "Error - " << participants[i].name << " is not listening on port " << basePort + i << endl;
+                    stopAll();
+                    return false;
+                }
+                usleep(10000);
+            }
+        }
+        
+        uint64_t start = monotonicTime();
+        coordinator = startNode("coordinator", coordinatorBinary);
+        bool finished = waitForNode(coordinator, timeout * 1000);
+        elapsed = (monotonicTime() - start) / 1e9;
+        
+        if (!finished)
+        {
+            stopAll();
+            return false;
+        }
+        
+        // Participants exit once the coordinator tells them it is done
+        for (int i = 0;i < participants.size();i ++)
+        {
+            finished = waitForNode(participants[i], 10000) && finished;
+        }
+        
+        return finished;
+    }
+    
+    vector<LatencyRecord> readLatencies()
+    {
+        vector<string> lines = readFile(runDirectory + "/coordinator/latency.txt");
+        vector<LatencyRecord> records;
+        for (int i = 0;i < lines.size();i ++)
+        {
+            vector<string> fields = split(lines[i], ' ');
+            if (fields.size() < 6)
+            {
+                continue;
+            }
+            
+            LatencyRecord record;
+            record.committed = (fields[1] == "commit");
+            record.start = stoull(fields[2]);
+            record.prepare = stoull(fields[3]);
+            record.log = stoull(fields[4]);
+            record.decision = stoull(fields[5]);
+            records.push_back(record);
+        }
+        
+        return records;
+    }
+    
+    // Nearest rank percentile of sorted values
+    static uint64_t percentile(vector<uint64_t> & sorted, double fraction)
+    {
+        if (sorted.empty())
+        {
+            return 0;
+        }
+        
+        size_t rank = (size_t) ceil(fraction * sorted.size());
+        return sorted[min(sorted.size(), max((size_t) 1, rank)) - 1];
+    }
+    
+    static string phaseJson(string name, vector<uint64_t> values)
+    {
+        sort(values.begin(), values.end());
+        
+        ostringstream json;
+        json << "\"" << name << "\": {\"p50\": " << percentile(values, 0.5) << ", \"p99\": " << percentile(values, 0.99)
+             << ", \"p999\": " << percentile(values, 0.999) << ", \"max\": " << (values.empty() ? 0 : values.back()) << "}";
+        return json.str();
+    }
+    
+    void report(bool finished)
+    {
+        vector<LatencyRecord> records = readLatencies();
+        
+        int committed = 0;
+        uint64_t first = UINT64_MAX;
+        uint64_t last = 0;
+        vector<uint64_t> prepare, log, decision, total;
+        for (int i = 0;i < records.size();i ++)
+        {
+            LatencyRecord & r = records[i];
+            committed += (r.committed ? 1 : 0);
+            
+            uint64_t duration = r.prepare + r.log + r.decision;
+            first = min(first, r.start);
+            last = max(last, r.start + duration);
+            
+            prepare.push_back(r.prepare);
+            log.push_back(r.log);
+            decision.push_back(r.decision);
+            total.push_back(duration);
+        }
+        int aborted = (int) records.size() - committed;
+        
+        // Rates are over the span from the first transaction's start to the
+        // last one's end, leaving out connection setup and shutdown
+        double seconds = (last > first ? (last - first) / 1e6 : 0);
+        
+        ostringstream json;
+        json.setf(ios::fixed);
+        json.precision(3);
+        json << "{" << endl;
+        json << "  \"finished\": " << (finished ? "true" : "false") << "," << endl;
+        json << "  \"requests\": " << requests << "," << endl;
+        json << "  \"participants\": " << participantCount << "," << endl;
+        json << "  \"window\": " << window << "," << endl;
+        json << "  \"batch\": " << batch << "," << endl;
+        json << "  \"completed\": " << records.size() << "," << endl;
+        json << "  \"committed\": " << committed << "," << endl;
+        json << "  \"aborted\": " << aborted << "," << endl;
+        json << "  \"elapsed_seconds\": " << elapsed << "," << endl;
+        json << "  \"active_seconds\": " << seconds << "," << endl;
+        json << "  \"committed_per_second\": " << (seconds > 0 ? committed / seconds : 0) << "," << endl;
+        json << "  \"aborted_per_second\": " << (seconds > 0 ? aborted / seconds : 0) << "," << endl;
+        json << "  \"latency_us\": {" << endl;
+        json << "    " << phaseJson("prepare", prepare) << "," << endl;
+        json << "    " << phaseJson("log", log) << "," << endl;
+        json << "    " << phaseJson("decision", decision) << "," << endl;
+        json << "    " << phaseJson("total", total) << endl;
+        json << "  }" << endl;
+        json << "}" << endl;
+        
+        cout << json.str();
+        writeFile(runDirectory + "/results.json", json.str());
+    }
+
+public:
+    
+    // ** Public Functions **
+    
+    // Constructor
+    Benchmark(string configFilename)
+    {
+        configFile = configFilename;
+        readConfigFile();
+    }
+    
+    // Run the workload once and print the results, false if a node failed
+    bool run()
+    {
+        cerr << "Generating " << requests << " bookings for " << participantCount << " participants in " << runDirectory << endl;
+        writeConfigs();
+        
+        cerr << "Running..." << endl;
+        bool finished = runNodes();
+        
+        report(finished);
+        return finished;
+    }
+};
+
+// Main function
+int main(int argc, const char * argv[])
+{
+    if (argc != 2)
+    {
+        cout << "Error - wrong command line arguments" << endl;
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    Benchmark bench(argv[1]);
+    return (bench.run() ? 0 : 1);
+}
@@ -13,12 +13,26 @@
 #include <sstream>
 #include <pthread.h>
 #include <cstring>
+#include <cstdint>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <netdb.h>
-#include <queue>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <map>
+#include <set>
+#include <atomic>
+#include <utility>
+#include <new>
+#include <deque>
+#include <algorithm>
+#include <iterator>
 #include <time.h>
 #include <signal.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -33,7 +47,8 @@ enum ActionType
 enum VoteStatus
 {
     VOTE_NO = 0,
-    VOTE_YES = 1
+    VOTE_YES = 1,
+    VOTE_READ_ONLY = 2
 };
 
 enum SystemStatus
@@ -44,61 +59,532 @@ enum SystemStatus
     FINISHED = 3
 };
 
+enum MessageType
+{
+    MSG_PREPARE = 1,
+    MSG_VOTE = 2,
+    MSG_DECISION = 3,
+    MSG_ACK = 4,
+    MSG_FINISH = 5,
+    MSG_PREPARE_BATCH = 6,
+    MSG_VOTE_BATCH = 7,
+    MSG_INQUIRY = 8,
+    MSG_ONE_PHASE = 9
+};
+
+const uint16_t PROTOCOL_VERSION = 1;
+const uint32_t MAX_FRAME_PAYLOAD = 1 << 20;
+const int RECIEVE_BUFFER_SIZE = 1 << 16;
+const int CACHE_LINE_SIZE = 64;
+
+// Slots in each substrate queue
+const int RING_CAPACITY = 4096;
+
+// Bookings parsed ahead of the transactions that use them
+const int INGEST_QUEUE_CAPACITY = 4096;
+
+enum DecisionRecordType
+{
+    LOG_COMMIT = 1,
+    LOG_ROLLBACK = 2,
+    LOG_END = 3
+};
+
+// Each decision log record is this header followed by length bytes of
+// payload, the booking file record the transaction came from
+struct DecisionRecord
+{
+    uint32_t type;
+    uint32_t length;
+    uint64_t transactionId;
+    uint64_t lsn;
+    uint32_t checksum;
+    uint32_t reserved;
+};
+
+// A binary booking file is this header, then recordCount fixed width
+// records, then the date lists too long or scattered for a record, then
+// nameCount participant names of BOOKING_NAME_LENGTH bytes each. Fields
+// are in host byte order.
+const char BOOKING_FILE_MAGIC[8] = {'B', 'O', 'O', 'K', 'I', 'N', 'G', 'S'};
+const uint32_t BOOKING_FILE_VERSION = 1;
+const int BOOKING_NAME_LENGTH = 32;
+const int MAX_BOOKING_NAMES = 32;
+
+struct BookingFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t recordCount;
+    uint64_t recordsOffset;
+    uint64_t datesOffset;
+    uint64_t dateCount;
+    uint64_t namesOffset;
+    uint32_t nameCount;
+    uint32_t reserved;
+};
+
+enum BookingDateKind
+{
+    DATES_RANGE = 1,
+    DATES_BITMAP = 2,
+    DATES_LIST = 3
+};
+
+// A range is dates consecutive dates from first, a bitmap sets bit i for
+// date first + i, and a list is dates entries of the date section from
+// index first. Bit i of participants is name i, none means all of them.
+struct BookingRecord
+{
+    int32_t id;
+    int32_t tickets;
+    uint32_t kind;
+    uint32_t participants;
+    int64_t first;
+    uint64_t dates;
+};
+
+struct DecisionEntry
+{
+    DecisionRecordType type;
+    uint64_t transactionId;
+    uint64_t lsn;
+    vector<int> payload;
+};
+
 SystemStatus system_status;
 
+// Nanoseconds on the monotonic clock
+uint64_t monotonicTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Every message on the wire starts with this header, followed by
+// length bytes of payload. Fields are in host byte order.
+struct FrameHeader
+{
+    uint16_t type;
+    uint16_t version;
+    uint32_t length;
+    uint64_t transactionId;
+    uint64_t timestamp;
+};
+
+// Pooled packet buffers come in power of two sizes from 64 bytes to 64KB.
+// Bigger frames are allocated on their own.
+const int POOL_CLASSES = 11;
+const int POOL_MIN_SHIFT = 6;
+
+// Buffers a thread keeps of each size before handing half of them back
+const int POOL_CACHE_LIMIT = 64;
+
+// Sits in front of every packet buffer
+struct BufferHeader
+{
+    atomic<int> references;
+    int sizeClass;
+    BufferHeader * next;
+};
+
+// Recycles packet buffers instead of going to the heap for every message.
+// Each thread takes from and returns to its own cache, and only touches the
+// shared depot, a batch at a time, when its cache runs empty or over.
+class BufferPool
+{
+private:
+    
+    // ** Class Parameters **
+    
+    struct ThreadCache
+    {
+        BufferHeader * buffers[POOL_CLASSES];
+        int counts[POOL_CLASSES];
+        
+        ThreadCache();
+        ~ThreadCache();
+    };
+    
+    pthread_mutex_t depotLock;
+    BufferHeader * depot[POOL_CLASSES];
+    
+    // ** Private Functions **
+    
+    static ThreadCache & threadCache()
+    {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+    
+    static int sizeClassFor(size_t length)
+    {
+        int sizeClass = 0;
+        while (sizeClass < POOL_CLASSES && ((size_t)1 << (sizeClass + POOL_MIN_SHIFT)) < length)
+        {
+            sizeClass ++;
+        }
+        return (sizeClass < POOL_CLASSES ? sizeClass : -1);
+    }
+    
+    static BufferHeader * createBuffer(int sizeClass, size_t length)
+    {
+        size_t capacity = (sizeClass < 0 ? length : (size_t)1 << (sizeClass + POOL_MIN_SHIFT));
+        char * raw = new char[sizeof(BufferHeader) + capacity];
+        
+        BufferHeader * buffer = new (raw) BufferHeader();
+        buffer->sizeClass = sizeClass;
+        buffer->next = NULL;
+        return buffer;
+    }
+    
+    static void destroyBuffer(BufferHeader * buffer)
+    {
+        buffer->~BufferHeader();
+        delete [] (char *)buffer;
+    }
+    
+    // Move up to count buffers of one size between a cache and the depot
+    void refill(ThreadCache & cache, int sizeClass, int count)
+    {
+        pthread_mutex_lock(&depotLock);
+        while (count -- > 0 && depot[sizeClass] != NULL)
+        {
+            BufferHeader * buffer = depot[sizeClass];
+            depot[sizeClass] = buffer->next;
+            buffer->next = cache.buffers[sizeClass];
+            cache.buffers[sizeClass] = buffer;
+            cache.counts[sizeClass] ++;
+        }
+        pthread_mutex_unlock(&depotLock);
+    }
+    
+    void spill(ThreadCache & cache, int sizeClass, int count)
+    {
+        pthread_mutex_lock(&depotLock);
+        while (count -- > 0 && cache.buffers[sizeClass] != NULL)
+        {
+            BufferHeader * buffer = cache.buffers[sizeClass];
+            cache.buffers[sizeClass] = buffer->next;
+            cache.counts[sizeClass] --;
+            buffer->next = depot[sizeClass];
+            depot[sizeClass] = buffer;
+        }
+        pthread_mutex_unlock(&depotLock);
+    }
+    
+    // Hand a finished thread's buffers to the depot for the others
+    void returnCache(ThreadCache & cache)
+    {
+        for (int i = 0;i < POOL_CLASSES;i ++)
+        {
+            spill(cache, i, cache.counts[i]);
+        }
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    BufferPool()
+    {
+        pthread_mutex_init(&depotLock, NULL);
+        for (int i = 0;i < POOL_CLASSES;i ++)
+        {
+            depot[i] = NULL;
+        }
+    }
+    
+    // A buffer of at least length bytes holding one reference
+    char * allocate(size_t length)
+    {
+        int sizeClass = sizeClassFor(length);
+        BufferHeader * buffer = NULL;
+        
+        if (sizeClass >= 0)
+        {
+            ThreadCache & cache = threadCache();
+            if (cache.buffers[sizeClass] == NULL)
+            {
+                refill(cache, sizeClass, POOL_CACHE_LIMIT / 2);
+            }
+            
+            buffer = cache.buffers[sizeClass];
+            if (buffer != NULL)
+            {
+                cache.buffers[sizeClass] = buffer->next;
+                cache.counts[sizeClass] --;
+            }
+        }
+        
+        if (buffer == NULL)
+        {
+            buffer = createBuffer(sizeClass, length);
+        }
+        
+        buffer->references.store(1, memory_order_relaxed);
+        return (char *)(buffer + 1);
+    }
+    
+    void retain(char * data)
+    {
+        ((BufferHeader *)data - 1)->references.fetch_add(1, memory_order_relaxed);
+    }
+    
+    // Drop a reference, recycling the buffer with the last one
+    void release(char * data)
+    {
+        BufferHeader * buffer = (BufferHeader *)data - 1;
+        if (buffer->references.fetch_sub(1, memory_order_acq_rel) != 1)
+        {
+            return;
+        }
+        
+        if (buffer->sizeClass < 0)
+        {
+            destroyBuffer(buffer);
+            return;
+        }
+        
+        ThreadCache & cache = threadCache();
+        buffer->next = cache.buffers[buffer->sizeClass];
+        cache.buffers[buffer->sizeClass] = buffer;
+        
+        if (++ cache.counts[buffer->sizeClass] > POOL_CACHE_LIMIT)
+        {
+            spill(cache, buffer->sizeClass, POOL_CACHE_LIMIT / 2);
+        }
+    }
+};
+
+BufferPool packetPool;
+
+BufferPool::ThreadCache::ThreadCache()
+{
+    for (int i = 0;i < POOL_CLASSES;i ++)
+    {
+        buffers[i] = NULL;
+        counts[i] = 0;
+    }
+}
+
+BufferPool::ThreadCache::~ThreadCache()
+{
+    packetPool.returnCache(*this);
+}
+
 struct Packet
 {
     int socket;
-    int * data;
+    char * data;
     int length;
-    int timestamp;
     
-    void sendPacket()
+    FrameHeader * header()
+    {
+        return (FrameHeader *)data;
+    }
+    
+    int * payload()
+    {
+        return (int *)(data + sizeof(FrameHeader));
+    }
+    
+    // Give the buffer back to the pool once every holder has released it
+    void release()
+    {
+        packetPool.release(data);
+        data = NULL;
+    }
+    
+    // Another reference to the same frame, to send it to another socket too
+    Packet share(int otherSocket)
+    {
+        packetPool.retain(data);
+        
+        Packet p = *this;
+        p.socket = otherSocket;
+        return p;
+    }
+    
+    // Allocate a frame with room for payloadInts ints after the header
+    static Packet createFrame(int socket, MessageType type, uint64_t transactionId, int payloadInts)
     {
-        send(socket, data, length, 0);
+        Packet p;
+        
+        p.socket = socket;
+        p.length = (int)(sizeof(FrameHeader) + payloadInts * sizeof(int));
+        p.data = packetPool.allocate(p.length);
+        
+        FrameHeader * header = p.header();
+        header->type = type;
+        header->version = PROTOCOL_VERSION;
+        header->length = payloadInts * sizeof(int);
+        header->transactionId = transactionId;
+        header->timestamp = monotonicTime();
+        
+        return p;
     }
     
-    static Packet createFromRawData(int * data, int socket, int length)
+    static Packet createFromRawData(const char * data, int socket, int length)
     {
         Packet p;
         
         p.socket = socket;
-        p.data = data;
+        p.data = packetPool.allocate(length);
+        memcpy(p.data, data, length);
         p.length = length;
-        p.timestamp = data[0];
         
         return p;
     }
 };
 
+// A participant from the config, by the name booking lines use for it
+struct ParticipantAddress
+{
+    string name;
+    string address;
+};
+
+struct Connection
+{
+    int socket;
+    string name;
+    string readBuffer;
+    string writeBuffer;
+    bool writeBlocked;
+};
+
 struct Response
 {
     int requestId = 0;
     bool ack;
+    bool inquiry = false;
     VoteStatus status;
     int socket;
     
-    static Response createFromPacket(Packet p)
+    static Response createFromPacket(Packet & p)
     {
         Response res;
         
-        res.ack = (p.length == sizeof(int) * 2);
-        res.requestId = p.data[1];
-        if (!res.ack)
+        res.ack = (p.header()->type == MSG_ACK);
+        res.inquiry = (p.header()->type == MSG_INQUIRY);
+        res.requestId = (int) p.header()->transactionId;
+        if (!res.ack && !res.inquiry)
         {
-            res.status = VoteStatus(p.data[2]);
+            res.status = VoteStatus(p.payload()[0]);
         }
         res.socket = p.socket;
         
         return res;
     }
+    
+    // Votes in a vote vector of [count, (id, vote)...]
+    static int batchSize(Packet & p)
+    {
+        return min(p.payload()[0], (int)((p.header()->length / sizeof(int) - 1) / 2));
+    }
+    
+    // Read one vote straight out of a vote vector
+    static Response createFromBatchPacket(Packet & p, int index)
+    {
+        Response res;
+        
+        int * payload = p.payload();
+        res.ack = false;
+        res.requestId = payload[1 + index * 2];
+        res.status = VoteStatus(payload[2 + index * 2]);
+        res.socket = p.socket;
+        
+        return res;
+    }
+};
+
+// Bookings name a handful of dates, so up to this many are kept inline
+const int INLINE_DATES = 12;
+
+// The dates of one request. Short lists live inside the object, so
+// decoding and copying a request doesn't touch the heap, and only a list
+// longer than INLINE_DATES moves out to a vector.
+struct DateList
+{
+    typedef int value_type;
+    
+    int count = 0;
+    int inlineDates[INLINE_DATES];
+    vector<int> spilled;
+    
+    int * begin()
+    {
+        return (count > INLINE_DATES ? spilled.data() : inlineDates);
+    }
+    
+    int * end()
+    {
+        return begin() + count;
+    }
+    
+    int size()
+    {
+        return count;
+    }
+    
+    bool empty()
+    {
+        return count == 0;
+    }
+    
+    int & operator[](int i)
+    {
+        return begin()[i];
+    }
+    
+    void clear()
+    {
+        count = 0;
+        spilled.clear();
+    }
+    
+    void push_back(int date)
+    {
+        if (count < INLINE_DATES)
+        {
+            inlineDates[count] = date;
+        }
+        else
+        {
+            if (count == INLINE_DATES)
+            {
+                spilled.assign(inlineDates, inlineDates + INLINE_DATES);
+            }
+            spilled.push_back(date);
+        }
+        count ++;
+    }
+    
+    template <typename Iterator>
+    void assign(Iterator first, Iterator last)
+    {
+        clear();
+        for (;first != last;first ++)
+        {
+            push_back(*first);
+        }
+    }
 };
 
 struct BookingRequest
 {
     int id;
     int tickets;
-    vector<int> dates;
+    
+    // Byte offset in the booking file of the record after this one
+    uint64_t nextOffset = 0;
+    DateList dates;
+    
+    // Participants the booking touches, all of them when empty
+    vector<string> participants;
     
     void print()
     {
@@ -110,56 +596,130 @@ struct BookingRequest
         cout << endl;
     }
     
-    Packet getPacket(int socket)
+    Packet getPacket(int socket, MessageType type)
     {
-        Packet p;
-        
-        int l = (int) dates.size() + 4;
+        Packet p = Packet::createFrame(socket, type, id, (int) dates.size() + 2);
         
-        time_t currentTime;
-        time(&currentTime);
-        p.timestamp = (int)currentTime;
-        
-        int * intData = new int[l];
-        intData[0] = p.timestamp;
-        intData[1] = id;
-        intData[2] = tickets;
-        intData[3] = (int) dates.size();
+        int * payload = p.payload();
+        payload[0] = tickets;
+        payload[1] = (int) dates.size();
         for (int i = 0;i < dates.size();i ++)
         {
-            intData[4 + i] = dates[i];
+            payload[2 + i] = dates[i];
         }
         
-        p.data = intData;
-        p.length = sizeof(int) * l;
-        p.socket = socket;
-        
         return p;
     }
     
-    Packet createActionPacket(int socket, ActionType action)
+    // One phase requests add [record, lowWater] after the dates. The
+    // participant answers a resend of the same record from the outcome it
+    // kept, and forgets the outcomes of records before lowWater, which are
+    // complete and never resent.
+    Packet createOnePhasePacket(int socket, int record, int lowWater)
     {
-        Packet p;
+        int dateCount = (int) dates.size();
+        Packet p = Packet::createFrame(socket, MSG_ONE_PHASE, id, dateCount + 4);
         
-        p.socket = socket;
+        int * payload = p.payload();
+        payload[0] = tickets;
+        payload[1] = dateCount;
+        for (int i = 0;i < dateCount;i ++)
+        {
+            payload[2 + i] = dates[i];
+        }
+        payload[2 + dateCount] = record;
+        payload[3 + dateCount] = lowWater;
+        
+        return p;
+    }
+    
+    // Decisions are [action, ackRequired]
+    Packet createActionPacket(int socket, ActionType action, bool ackRequired)
+    {
+        Packet p = Packet::createFrame(socket, MSG_DECISION, id, 2);
         
-        int * data = new int[3];
+        p.payload()[0] = action;
+        p.payload()[1] = ackRequired;
         
-        time_t currentTime;
-        time(&currentTime);
+        return p;
+    }
+    
+    // Pack several requests into one frame of [count, (id, tickets, dateCount, dates...)...]
+    static Packet createBatchPacket(int socket, vector<BookingRequest> & batch)
+    {
+        int l = 1;
+        for (int i = 0;i < batch.size();i ++)
+        {
+            l += 3 + (int) batch[i].dates.size();
+        }
         
-        data[0] = (int)currentTime;
-        data[1] = id;
-        data[2] = action;
+        Packet p = Packet::createFrame(socket, MSG_PREPARE_BATCH, batch[0].id, l);
         
-        p.data = data;
-        p.length = sizeof(int) * 3;
-        p.timestamp = data[0];
+        int * payload = p.payload();
+        int pos = 0;
+        payload[pos ++] = (int) batch.size();
+        for (int i = 0;i < batch.size();i ++)
+        {
+            BookingRequest & req = batch[i];
+            payload[pos ++] = req.id;
+            payload[pos ++] = req.tickets;
+            payload[pos ++] = (int) req.dates.size();
+            for (int j = 0;j < req.dates.size();j ++)
+            {
+                payload[pos ++] = req.dates[j];
+            }
+        }
         
         return p;
     }
 };
 
+enum TransactionState
+{
+    PREPARED = 0,
+    VOTED = 1,
+    DECIDED = 2,
+    ACKED = 3
+};
+
+// Names the timer watching one phase of a transaction. Every timer gets a
+// new sequence number, so one left over from an earlier phase is ignored.
+struct TransactionTimer
+{
+    int id;
+    uint64_t sequence;
+};
+
+struct Transaction
+{
+    BookingRequest request;
+    TransactionState state;
+    ActionType decision;
+    int record;
+    uint64_t decisionLsn;
+    
+    // Sockets the booking touches, and the yes voters that take part in
+    // phase 2. A booking touching one participant is committed in one phase.
+    vector<int> participants;
+    set<int> phaseTwo;
+    bool onePhase;
+    
+    map<int, VoteStatus> votes;
+    set<int> acks;
+    
+    // Sequence number of the timer watching the current phase, and how
+    // many times the prepare went unanswered
+    uint64_t timer;
+    int prepareTimeouts;
+    
+    // Monotonic nanoseconds when the transaction started, when the last
+    // vote came in and when the decision went out
+    uint64_t startedAt;
+    uint64_t preparedAt;
+    uint64_t votedAt;
+    uint64_t decidedAt;
+};
+
 // ** Global Functions **
 
 // Split string by a delimeter into a vector of tokens
@@ -177,400 +737,3229 @@ vector<string> split(string fullString, char delimiter)
     return splits;
 }
 
-class CommunicationSubstrate
+// FNV-1a, enough to spot a torn or garbled record
+uint32_t checksum(const char * data, size_t length, uint32_t hash)
+{
+    for (size_t i = 0;i < length;i ++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Bounded queue that any number of threads can push to and pop from without
+// a lock. Each slot's sequence number says whether it is waiting for a push
+// or a pop on the current lap, so a push or pop is one compare-and-swap on
+// the tail or head plus one store, and nothing is allocated after creation.
+template <typename T>
+class RingBuffer
 {
 private:
     
     // ** Class Parameters **
     
-    pthread_t bufferThread;
-    pthread_t recieveThread;
+    struct Slot
+    {
+        atomic<size_t> sequence;
+        T value;
+    };
     
-    queue<Packet> inputBuffer;
-    queue<Packet> outputBuffer;
+    Slot * slots;
+    size_t mask;
     
-    sockaddr_in hotel;
-    sockaddr_in concert;
+    // Apart so producers and consumers don't fight over one cache line
+    alignas(CACHE_LINE_SIZE) atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) atomic<size_t> tail;
+    alignas(CACHE_LINE_SIZE) atomic<int> waiters;
     
-    int hotelSocket;
-    int concertSocket;
+    // Bumped by wake, so a waiter can tell it was woken with nothing queued
+    atomic<uint64_t> wakeups;
     
-    queue<Response> responseBuffer;
+    pthread_mutex_t waitLock;
+    pthread_cond_t changed;
     
     // ** Private Functions **
     
-    void populateIPAddress(sockaddr_in * address, string addressInfo)
+    // Wake anyone blocked in a wait, skipping the lock when nobody is
+    void notify()
     {
-        address->sin_family = AF_INET;
-        vector<string> addressParts = split(addressInfo, ':');
-        address->sin_port = htons(stoi(addressParts[1]));
-        inet_pton(AF_INET, addressParts[0].c_str(), &address->sin_addr);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (waiters.load() > 0)
+        {
+            pthread_mutex_lock(&waitLock);
+            pthread_cond_broadcast(&changed);
+            pthread_mutex_unlock(&waitLock);
+        }
     }
     
-    void connectToParticipants()
+    // Block until the buffer has items (or space), wake is called after
+    // wakeCount was read, or timeoutMs passes. A negative timeout waits for
+    // as long as it takes.
+    bool waitFor(bool forItems, int timeoutMs, uint64_t wakeCount)
     {
-        if (connect(hotelSocket, (sockaddr *)&hotel, sizeof(hotel)) != 0)
+        timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        if (timeoutMs >= 0)
         {
-            cout << "Error - Couldn't connect to hotel participant" << endl;
-            exit(1);
+            deadline.tv_sec += timeoutMs / 1000;
+            deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec ++;
+                deadline.tv_nsec -= 1000000000;
+            }
         }
         
-        if (connect(concertSocket, (sockaddr *)&concert, sizeof(concert)) != 0)
+        waiters ++;
+        pthread_mutex_lock(&waitLock);
+        bool ready = (forItems ? !empty() : freeSpace() > 0);
+        while (!ready && wakeups.load() == wakeCount)
         {
-            cout << "Error - Couldn't connect to concert participant" << endl;
-            exit(1);
+            if (timeoutMs < 0)
+            {
+                pthread_cond_wait(&changed, &waitLock);
+            }
+            else if (pthread_cond_timedwait(&changed, &waitLock, &deadline) != 0)
+            {
+                ready = (forItems ? !empty() : freeSpace() > 0);
+                break;
+            }
+            ready = (forItems ? !empty() : freeSpace() > 0);
         }
+        pthread_mutex_unlock(&waitLock);
+        waiters --;
+        
+        return ready;
     }
     
-    // Function to start thread D
-    static void *messageRecieveThreadCaller(void * context)
+    bool tryPush(T & item)
     {
-        return ((CommunicationSubstrate *)context)->recieveMessages(NULL);
+        size_t pos = tail.load(memory_order_relaxed);
+        while (true)
+        {
+            Slot & slot = slots[pos & mask];
+            size_t sequence = slot.sequence.load(memory_order_acquire);
+            intptr_t lap = (intptr_t)sequence - (intptr_t)pos;
+            
+            if (lap == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    slot.value = move(item);
+                    slot.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (lap < 0)
+            {
+                // Full, the slot still holds last lap's item
+                return false;
+            }
+            else
+            {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
     }
     
-    void recieveDataFromSocket(int socket, int * buffer)
+    bool tryPop(T & item)
     {
-        size_t bytesRecieved = recv(socket, buffer, 64, 0);
-        if (bytesRecieved > 0)
+        size_t pos = head.load(memory_order_relaxed);
+        while (true)
         {
-            Packet packet = Packet::createFromRawData(buffer, socket, (int) bytesRecieved);
-            if (system_status == NORMAL)
+            Slot & slot = slots[pos & mask];
+            size_t sequence = slot.sequence.load(memory_order_acquire);
+            intptr_t lap = (intptr_t)sequence - (intptr_t)(pos + 1);
+            
+            if (lap == 0)
+            {
+                if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    item = move(slot.value);
+                    slot.sequence.store(pos + mask + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (lap < 0)
+            {
+                // Empty, the slot hasn't been filled this lap
+                return false;
+            }
+            else
             {
-                inputBuffer.push(packet);
+                pos = head.load(memory_order_relaxed);
             }
         }
     }
     
-    // Threaded function to recieve messages
-    void * recieveMessages(void *)
+public:
+    
+    // ** Public Functions **
+    
+    // Capacity is rounded up to a power of two
+    RingBuffer(size_t capacity)
     {
-        int * buffer = new int[64];
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
         
-        while (system_status != FINISHED)
+        slots = new Slot[size];
+        mask = size - 1;
+        for (size_t i = 0;i < size;i ++)
         {
-            recieveDataFromSocket(hotelSocket, buffer);
-            recieveDataFromSocket(concertSocket, buffer);
+            slots[i].sequence.store(i, memory_order_relaxed);
         }
         
-        pthread_exit(NULL);
+        head.store(0);
+        tail.store(0);
+        waiters.store(0);
+        wakeups.store(0);
+        pthread_mutex_init(&waitLock, NULL);
+        
+        // Timed waits measure against the monotonic clock, so a wall clock
+        // step neither cuts them short nor stretches them
+        pthread_condattr_t attributes;
+        pthread_condattr_init(&attributes);
+        pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+        pthread_cond_init(&changed, &attributes);
+        pthread_condattr_destroy(&attributes);
     }
     
-    // Function to start thread C
-    static void *substrateThreadCaller(void * context)
+    ~RingBuffer()
     {
-        return ((CommunicationSubstrate *)context)->processBuffers(NULL);
+        delete [] slots;
+        pthread_mutex_destroy(&waitLock);
+        pthread_cond_destroy(&changed);
     }
     
-    // Threaded function to process buffers
-    void * processBuffers(void *)
+    // Both return false instead of waiting when the buffer is full or empty
+    bool push(T & item)
     {
-        while (system_status != FINISHED)
+        bool pushed = tryPush(item);
+        if (pushed)
+        {
+            notify();
+        }
+        return pushed;
+    }
+    
+    bool pop(T & item)
+    {
+        bool popped = tryPop(item);
+        if (popped)
+        {
+            notify();
+        }
+        return popped;
+    }
+    
+    // Push items from the front of the vector until it is empty or the
+    // buffer is full, and return how many went in
+    int pushBatch(vector<T> & items)
+    {
+        int count = 0;
+        while (count < items.size() && tryPush(items[count]))
+        {
+            count ++;
+        }
+        items.erase(items.begin(), items.begin() + count);
+        
+        if (count > 0)
+        {
+            notify();
+        }
+        return count;
+    }
+    
+    // Append up to maxItems items to the vector and return how many
+    int popBatch(vector<T> & items, int maxItems)
+    {
+        int count = 0;
+        T item;
+        while (count < maxItems && tryPop(item))
+        {
+            items.push_back(move(item));
+            count ++;
+        }
+        
+        if (count > 0)
+        {
+            notify();
+        }
+        return count;
+    }
+    
+    // Exact only when no push or pop is in flight, but a single producer
+    // can always count on at least freeSpace() more pushes succeeding
+    size_t size()
+    {
+        size_t tailPos = tail.load();
+        size_t headPos = head.load();
+        return (tailPos > headPos ? tailPos - headPos : 0);
+    }
+    
+    size_t freeSpace()
+    {
+        size_t used = size();
+        return (used > mask ? 0 : mask + 1 - used);
+    }
+    
+    bool empty()
+    {
+        return size() == 0;
+    }
+    
+    bool waitForItems(int timeoutMs)
+    {
+        return waitFor(true, timeoutMs, wakeups.load());
+    }
+    
+    // Also returns early once wake is called after wakeCount was read, so
+    // a consumer that checks other work first loses no wakeup in between
+    bool waitForItems(int timeoutMs, uint64_t wakeCount)
+    {
+        return waitFor(true, timeoutMs, wakeCount);
+    }
+    
+    bool waitForSpace(int timeoutMs)
+    {
+        return waitFor(false, timeoutMs, wakeups.load());
+    }
+    
+    uint64_t wakeCount()
+    {
+        return wakeups.load();
+    }
+    
+    // End every wait in progress, whether or not anything was queued
+    void wake()
+    {
+        wakeups ++;
+        notify();
+    }
+};
+
+// Timer wheels tick once a millisecond. Each level has 64 slots, and a
+// slot on one level spans a whole lap of the level below, so four levels
+// reach about four and a half hours.
+const int TIMER_LEVELS = 4;
+const int TIMER_BITS = 6;
+const int TIMER_SLOTS = 1 << TIMER_BITS;
+
+// Hierarchical timer wheel on the monotonic clock. A timer is filed in the
+// lowest level whose lap covers its deadline, and moves down a level each
+// time the wheel reaches its slot, so scheduling is constant time and a
+// tick only looks at the timers that are due. Timers are never cancelled,
+// owners tell a stale one apart when it fires.
+template <typename T>
+class TimerWheel
+{
+private:
+    
+    // ** Class Parameters **
+    
+    struct Timer
+    {
+        uint64_t deadline;
+        T item;
+    };
+    
+    vector<Timer> slots[TIMER_LEVELS][TIMER_SLOTS];
+    
+    // Every tick up to current has been expired
+    uint64_t current;
+    size_t count = 0;
+    
+    // ** Private Functions **
+    
+    // File a timer no sooner than earliest. Anything past the top level's
+    // lap waits in its last slot to be filed again.
+    void file(const Timer & timer, uint64_t earliest)
+    {
+        uint64_t due = max(timer.deadline, earliest);
+        uint64_t span = (uint64_t) 1 << (TIMER_BITS * TIMER_LEVELS);
+        due = min(due, current + span - 1);
+        
+        int level = 0;
+        while (level < TIMER_LEVELS - 1 && due - current >= ((uint64_t) 1 << (TIMER_BITS * (level + 1))))
+        {
+            level ++;
+        }
+        
+        slots[level][(due >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)].push_back(timer);
+    }
+    
+    // Move the timers in a level's current slot down the wheel
+    void cascade(int level)
+    {
+        vector<Timer> timers;
+        timers.swap(slots[level][(current >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)]);
+        for (int i = 0;i < timers.size();i ++)
+        {
+            file(timers[i], current);
+        }
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    TimerWheel()
+    {
+        current = monotonicTime() / 1000000;
+    }
+    
+    // Milliseconds on the monotonic clock
+    static uint64_t now()
+    {
+        return monotonicTime() / 1000000;
+    }
+    
+    void schedule(const T & item, uint64_t deadline)
+    {
+        Timer timer;
+        timer.deadline = deadline;
+        timer.item = item;
+        
+        // The current tick has already been expired
+        file(timer, current + 1);
+        count ++;
+    }
+    
+    // Tick up to time, adding the items of every timer due by then to expired
+    void advance(uint64_t time, vector<T> & expired)
+    {
+        if (count == 0)
+        {
+            current = max(current, time);
+            return;
+        }
+        
+        while (current < time)
         {
-            if (!outputBuffer.empty())
+            current ++;
+            
+            // Higher levels first, so their timers can fall all the way down
+            for (int level = TIMER_LEVELS - 1;level > 0;level --)
             {
-                Packet p = outputBuffer.front();
-                p.sendPacket();
-                outputBuffer.pop();
+                if ((current & (((uint64_t) 1 << (TIMER_BITS * level)) - 1)) == 0)
+                {
+                    cascade(level);
+                }
             }
             
-            if (!inputBuffer.empty())
+            vector<Timer> & due = slots[0][current & (TIMER_SLOTS - 1)];
+            for (int i = 0;i < due.size();i ++)
             {
-                Packet p = inputBuffer.front();
-                Response res = Response::createFromPacket(p);
-                responseBuffer.push(res);
-                inputBuffer.pop();
+                expired.push_back(due[i].item);
             }
+            count -= due.size();
+            due.clear();
         }
-        
-        pthread_exit(NULL);
     }
     
-    void startSubstrate()
+    // The earliest time a timer could fire, exact for timers due within
+    // 64ms and otherwise when the next one moves down a level. Zero if
+    // there are none.
+    uint64_t nextExpiry()
     {
-        cout << "Starting communication substrate..." << endl;
+        if (count == 0)
+        {
+            return 0;
+        }
         
-        if (int s = pthread_create(&bufferThread, NULL, &CommunicationSubstrate::substrateThreadCaller, this))
+        uint64_t earliest = UINT64_MAX;
+        for (int level = 0;level < TIMER_LEVELS;level ++)
         {
-            cout << "Error creating buffer thread. Code - " << s << endl;
-            exit(1);
+            uint64_t lap = current >> (TIMER_BITS * level);
+            for (int i = 1;i <= TIMER_SLOTS;i ++)
+            {
+                if (!slots[level][(lap + i) & (TIMER_SLOTS - 1)].empty())
+                {
+                    earliest = min(earliest, (lap + i) << (TIMER_BITS * level));
+                    break;
+                }
+            }
+        }
+        return earliest;
+    }
+    
+    size_t size()
+    {
+        return count;
+    }
+    
+    void clear()
+    {
+        for (int level = 0;level < TIMER_LEVELS;level ++)
+        {
+            for (int i = 0;i < TIMER_SLOTS;i ++)
+            {
+                slots[level][i].clear();
+            }
+        }
+        count = 0;
+    }
+};
+
+// Histograms split each power of two into 16 linear buckets, so a value is
+// reported to within 1/16 of itself, and values below 32 are exact
+const int HISTOGRAM_SUB_BITS = 4;
+const int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+const int HISTOGRAM_BUCKETS = (65 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS;
+
+// Bucket bounds, in microseconds, of the histograms served to Prometheus
+const int PROMETHEUS_BOUNDS = 16;
+const uint64_t PROMETHEUS_BOUNDS_US[PROMETHEUS_BOUNDS] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+
+// Log-linear latency histogram in the style of HdrHistogram. Recording is
+// a few relaxed atomic adds, so any thread can record and a reader can
+// take percentiles at any time without stopping the writers.
+class LatencyHistogram
+{
+private:
+    
+    // ** Class Parameters **
+    
+    atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    atomic<uint64_t> total;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> maximum;
+    
+    // ** Private Functions **
+    
+    static int bucketFor(uint64_t value)
+    {
+        if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+        {
+            return (int) value;
         }
         
-        if (int s = pthread_create(&recieveThread, NULL, &CommunicationSubstrate::messageRecieveThreadCaller, this))
+        int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+        return shift * HISTOGRAM_SUB_BUCKETS + (int)(value >> shift);
+    }
+    
+    // Largest value that lands in a bucket
+    static uint64_t bucketLimit(int bucket)
+    {
+        if (bucket < 2 * HISTOGRAM_SUB_BUCKETS)
         {
-            cout << "Error creating message thread. Code - " << s << endl;
-            exit(1);
+            return bucket;
         }
         
-        cout << "Communication substrate started." << endl;
+        int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+        uint64_t low = (uint64_t)(bucket - shift * HISTOGRAM_SUB_BUCKETS) << shift;
+        return low + (((uint64_t) 1 << shift) - 1);
     }
     
 public:
     
     // ** Public Functions **
     
-    CommunicationSubstrate(string hotelIP, string concertIP)
+    LatencyHistogram()
+    {
+        for (int i = 0;i < HISTOGRAM_BUCKETS;i ++)
+        {
+            buckets[i] = 0;
+        }
+        total = 0;
+        sum = 0;
+        maximum = 0;
+    }
+    
+    void record(uint64_t value)
+    {
+        buckets[bucketFor(value)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(value, memory_order_relaxed);
+        
+        uint64_t seen = maximum.load(memory_order_relaxed);
+        while (value > seen && !maximum.compare_exchange_weak(seen, value, memory_order_relaxed))
+        {
+        }
+    }
+    
+    uint64_t count()
+    {
+        return total.load(memory_order_relaxed);
+    }
+    
+    uint64_t getSum()
     {
-        populateIPAddress(&hotel, hotelIP);
-        populateIPAddress(&concert, concertIP);
+        return sum.load(memory_order_relaxed);
+    }
+    
+    uint64_t getMax()
+    {
+        return maximum.load(memory_order_relaxed);
+    }
+    
+    // Smallest bucket limit that at least fraction of the values are under.
+    // Values recorded while this runs may or may not be counted.
+    uint64_t percentile(double fraction)
+    {
+        uint64_t counts[HISTOGRAM_BUCKETS];
+        uint64_t seen = 0;
+        for (int i = 0;i < HISTOGRAM_BUCKETS;i ++)
+        {
+            counts[i] = buckets[i].load(memory_order_relaxed);
+            seen += counts[i];
+        }
+        
+        uint64_t rank = max((uint64_t) 1, (uint64_t)(fraction * seen + 0.5));
+        uint64_t below = 0;
+        for (int i = 0;i < HISTOGRAM_BUCKETS && seen > 0;i ++)
+        {
+            below += counts[i];
+            if (below >= rank)
+            {
+                return min(bucketLimit(i), getMax());
+            }
+        }
+        return 0;
+    }
+    
+    // Prometheus histogram samples for a histogram of microseconds, in
+    // seconds. A bound counts the buckets that fall entirely under it.
+    string prometheus(string name, string labels)
+    {
+        uint64_t counts[HISTOGRAM_BUCKETS];
+        uint64_t seen = 0;
+        for (int i = 0;i < HISTOGRAM_BUCKETS;i ++)
+        {
+            counts[i] = buckets[i].load(memory_order_relaxed);
+            seen += counts[i];
+        }
+        
+        string bucketLabels = (labels.empty() ? "{" : "{" + labels + ",");
+        string sampleLabels = (labels.empty() ? "" : "{" + labels + "}");
+        
+        ostringstream text;
+        text.precision(12);
+        int bucket = 0;
+        uint64_t below = 0;
+        for (int i = 0;i < PROMETHEUS_BOUNDS;i ++)
+        {
+            while (bucket < HISTOGRAM_BUCKETS && bucketLimit(bucket) <= PROMETHEUS_BOUNDS_US[i])
+            {
+                below += counts[bucket ++];
+            }
+            text << name << "_bucket" << bucketLabels << "le=\"" << PROMETHEUS_BOUNDS_US[i] / 1e6 << "\"} " << below << "\n";
+        }
+        text << name << "_bucket" << bucketLabels << "le=\"+Inf\"} " << seen << "\n";
+        text << name << "_sum" << sampleLabels << " " << getSum() / 1e6 << "\n";
+        text << name << "_count" << sampleLabels << " " << seen << "\n";
+        return text.str();
+    }
+    
+    // "count N mean N p50 N p90 N p99 N p999 N max N"
+    string summary()
+    {
+        uint64_t n = count();
+        ostringstream text;
+        text << "count " << n << " mean " << (n > 0 ? getSum() / n : 0) << " p50 " << percentile(0.5) << " p90 " << percentile(0.9)
+             << " p99 " << percentile(0.99) << " p999 " << percentile(0.999) << " max " << getMax();
+        return text.str();
+    }
+};
+
+// How long each log flush took, in microseconds, and how many records it
+// made durable
+struct LogMetrics
+{
+    LatencyHistogram flushTime;
+    LatencyHistogram flushRecords;
+};
+
+// What the coordinator has seen of one participant. Round trips are in
+// microseconds, from sending a phase to handling the reply.
+struct ParticipantMetrics
+{
+    string name;
+    LatencyHistogram prepareTime;
+    LatencyHistogram decisionTime;
+    atomic<uint64_t> yesVotes{0};
+    atomic<uint64_t> noVotes{0};
+    atomic<uint64_t> readOnlyVotes{0};
+    atomic<uint64_t> acks{0};
+    
+    // Votes or acknowledgements still missing when a phase timed out
+    atomic<uint64_t> missed{0};
+};
+
+// Everything the stats command reports. Each value is written by the thread
+// that sees the event and read by the others without locking.
+struct CoordinatorMetrics
+{
+    // Fixed once the participants are connected
+    vector<ParticipantMetrics *> participants;
+    map<int, ParticipantMetrics *> bySocket;
+    
+    LatencyHistogram transactionTime;
+    LatencyHistogram batchWait;
+    LogMetrics decisionLog;
+    
+    atomic<uint64_t> committed{0};
+    atomic<uint64_t> aborted{0};
+    atomic<uint64_t> prepareTimeouts{0};
+    atomic<uint64_t> decisionTimeouts{0};
+    atomic<uint64_t> inquiries{0};
+    
+    // Sampled by the process thread each time it wakes
+    atomic<int> inFlight{0};
+    atomic<int> awaitingDecisions{0};
+    atomic<int> parsedBookings{0};
+};
+
+// Serves the metrics over HTTP on a loopback port or a Unix socket, one
+// request per connection, from its own thread. The text comes from a
+// callback that only reads the metrics, so a scrape never blocks the node.
+class MetricsServer
+{
+private:
+    
+    // ** Class Parameters **
+    
+    pthread_t serverThread;
+    int listenSocket;
+    string address;
+    
+    string (*render)(void *);
+    void * renderContext;
+    
+    // ** Private Functions **
+    
+    void listenOnPort(int port)
+    {
+        sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_port = htons(port);
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        
+        int reuse = 1;
+        listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (::bind(listenSocket, (sockaddr *)&local, sizeof(local)) != 0 || listen(listenSocket, 16) != 0)
+        {
+            cout << "Error - Could not serve metrics on " << address << " " << errno << endl;
+            exit(1);
+        }
+    }
+    
+    void listenOnSocket(string path)
+    {
+        sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(local.sun_path))
+        {
+            cout << "Error - Metrics socket path too long " << path << endl;
+            exit(1);
+        }
+        strcpy(local.sun_path, path.c_str());
         
-        hotelSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        concertSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        // Left behind by an earlier run
+        unlink(path.c_str());
         
-        connectToParticipants();
+        listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (::bind(listenSocket, (sockaddr *)&local, sizeof(local)) != 0 || listen(listenSocket, 16) != 0)
+        {
+            cout << "Error - Could not serve metrics on " << address << " " << errno << endl;
+            exit(1);
+        }
+    }
+    
+    // Function to start the metrics thread
+    static void * serverThreadCaller(void * context)
+    {
+        return ((MetricsServer *)context)->serveRequests(NULL);
+    }
+    
+    // Threaded function that answers one scrape at a time
+    void * serveRequests(void *)
+    {
+        while (true)
+        {
+            int client = accept(listenSocket, NULL, NULL);
+            if (client < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                {
+                    continue;
+                }
+                break;
+            }
+            
+            answerRequest(client);
+            close(client);
+        }
+        
+        pthread_exit(NULL);
+    }
+    
+    // Read the request head and send the metrics, whatever was asked for.
+    // A client that stalls is dropped after a second.
+    void answerRequest(int client)
+    {
+        timeval timeout;
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        
+        string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == string::npos && request.find("\n\n") == string::npos && request.size() < 8192)
+        {
+            ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                break;
+            }
+            request.append(buffer, n);
+        }
+        
+        string body = render(renderContext);
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(body.size()) +
+                          "\r\nConnection: close\r\n\r\n" + (request.compare(0, 5, "HEAD ") == 0 ? "" : body);
+        
+        size_t sent = 0;
+        while (sent < response.size())
+        {
+            ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                break;
+            }
+            sent += n;
+        }
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    // Listen on 127.0.0.1:port, or on the Unix socket at path if one is given
+    MetricsServer(int port, string path, string (*metricsCallback)(void *), void * context)
+    {
+        render = metricsCallback;
+        renderContext = context;
+        
+        if (!path.empty())
+        {
+            address = path;
+            listenOnSocket(path);
+        }
+        else
+        {
+            address = "127.0.0.1:" + to_string(port);
+            listenOnPort(port);
+        }
+        
+        if (int s = pthread_create(&serverThread, NULL, &MetricsServer::serverThreadCaller, this))
+        {
+            cout << "Error creating metrics thread. Code - " << s << endl;
+            exit(1);
+        }
+        pthread_detach(serverThread);
+        
+        cout << "Serving metrics on " << address << endl;
+    }
+};
+
+class CommunicationSubstrate
+{
+private:
+    
+    // ** Class Parameters **
+    
+    pthread_t reactorThread;
+    
+    int epollFd;
+    int wakeFd;
+    
+    // Frames the reactor has read, and packets queued for it to send
+    RingBuffer<Packet> inputBuffer;
+    RingBuffer<Packet> outputBuffer;
+    vector<Packet> outgoing;
+    
+    // Participant sockets in config order, and by name
+    vector<int> participantSockets;
+    map<string, int> socketsByName;
+    
+    map<int, Connection> connections;
+    
+    RingBuffer<Response> responseBuffer;
+    
+    // Responses decoded while responseBuffer was full. Input stays in the
+    // read buffers until the coordinator makes room.
+    deque<Response> heldResponses;
+    atomic<bool> inputStalled;
+    
+    // Bytes written to and read from every connection
+    atomic<uint64_t> totalBytesSent{0};
+    atomic<uint64_t> totalBytesRecieved{0};
+    
+    // ** Private Functions **
+    
+    void populateIPAddress(sockaddr_in * address, string addressInfo)
+    {
+        address->sin_family = AF_INET;
+        vector<string> addressParts = split(addressInfo, ':');
+        address->sin_port = htons(stoi(addressParts[1]));
+        inet_pton(AF_INET, addressParts[0].c_str(), &address->sin_addr);
+    }
+    
+    void connectToParticipants(vector<ParticipantAddress> & participants)
+    {
+        for (int i = 0;i < participants.size();i ++)
+        {
+            sockaddr_in address;
+            populateIPAddress(&address, participants[i].address);
+            
+            int participantSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (connect(participantSocket, (sockaddr *)&address, sizeof(address)) != 0)
+            {
+                cout << "Error - Couldn't connect to " << participants[i].name << " participant" << endl;
+                exit(1);
+            }
+            
+            registerConnection(participantSocket, participants[i].name);
+            participantSockets.push_back(participantSocket);
+            socketsByName[participants[i].name] = participantSocket;
+        }
+    }
+    
+    // Make a connected socket non-blocking and watch it for input
+    void registerConnection(int socket, string name)
+    {
+        fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+        
+        Connection & conn = connections[socket];
+        conn.socket = socket;
+        conn.name = name;
+        conn.writeBlocked = false;
+        
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = socket;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event);
+    }
+    
+    // Only ask for write readiness while output is backed up
+    void watchConnection(Connection & conn)
+    {
+        epoll_event event;
+        event.events = EPOLLIN | (conn.writeBlocked ? EPOLLOUT : 0);
+        event.data.fd = conn.socket;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.socket, &event);
+    }
+    
+    // Write as much pending output as the socket will take
+    void flushConnection(Connection & conn)
+    {
+        while (!conn.writeBuffer.empty())
+        {
+            ssize_t bytesSent = send(conn.socket, conn.writeBuffer.data(), conn.writeBuffer.size(), 0);
+            if (bytesSent < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    // Nothing queued can arrive whole any more
+                    cout << "Error - Could not send to " << conn.name << " participant " << errno << endl;
+                    conn.writeBuffer.clear();
+                    dropConnection(conn);
+                    return;
+                }
+                break;
+            }
+            conn.writeBuffer.erase(0, bytesSent);
+            totalBytesSent.fetch_add(bytesSent, memory_order_relaxed);
+        }
+        
+        bool blocked = !conn.writeBuffer.empty();
+        if (blocked != conn.writeBlocked)
+        {
+            conn.writeBlocked = blocked;
+            watchConnection(conn);
+        }
+    }
+    
+    // Move queued packets onto their connections and send them
+    void processOutput()
+    {
+        outgoing.clear();
+        outputBuffer.popBatch(outgoing, RING_CAPACITY);
+        
+        for (int i = 0;i < outgoing.size();i ++)
+        {
+            Packet & p = outgoing[i];
+            map<int, Connection>::iterator it = connections.find(p.socket);
+            if (it != connections.end())
+            {
+                it->second.writeBuffer.append(p.data, p.length);
+            }
+            p.release();
+        }
+        
+        for (map<int, Connection>::iterator it = connections.begin();it != connections.end();it ++)
+        {
+            flushConnection(it->second);
+        }
+    }
+    
+    // Hand a response to the coordinator, or hold it while there is no room
+    void deliverResponse(Response & res)
+    {
+        if (!heldResponses.empty() || !responseBuffer.push(res))
+        {
+            heldResponses.push_back(res);
+        }
+    }
+    
+    // Decode recieved packets into responses
+    void processInput()
+    {
+        while (!heldResponses.empty() && responseBuffer.push(heldResponses.front()))
+        {
+            heldResponses.pop_front();
+        }
+        
+        Packet p;
+        while (heldResponses.empty() && inputBuffer.pop(p))
+        {
+            if (p.header()->type == MSG_VOTE_BATCH)
+            {
+                int count = Response::batchSize(p);
+                for (int i = 0;i < count;i ++)
+                {
+                    Response vote = Response::createFromBatchPacket(p, i);
+                    deliverResponse(vote);
+                }
+            }
+            else
+            {
+                Response res = Response::createFromPacket(p);
+                deliverResponse(res);
+            }
+            p.release();
+        }
+        
+        inputStalled = !heldResponses.empty();
+    }
+    
+    // Decode the input held back while the coordinator was behind
+    void resumeInput()
+    {
+        processInput();
+        
+        for (map<int, Connection>::iterator it = connections.begin();it != connections.end() && !inputStalled;it ++)
+        {
+            if (it->second.readBuffer.empty())
+            {
+                continue;
+            }
+            
+            if (!decodeFrames(it->second))
+            {
+                dropConnection(it->second);
+            }
+            processInput();
+        }
+    }
+    
+    void dropConnection(Connection & conn)
+    {
+        cout << "Lost connection to " << conn.name << " participant" << endl;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.socket, NULL);
+    }
+    
+    // Split every complete frame off the front of the read buffer
+    bool decodeFrames(Connection & conn)
+    {
+        size_t offset = 0;
+        
+        while (conn.readBuffer.size() - offset >= sizeof(FrameHeader))
+        {
+            FrameHeader header;
+            memcpy(&header, conn.readBuffer.data() + offset, sizeof(header));
+            
+            if (header.version != PROTOCOL_VERSION || header.length > MAX_FRAME_PAYLOAD)
+            {
+                cout << "Error - Malformed frame from " << conn.name << " participant" << endl;
+                return false;
+            }
+            
+            size_t frameLength = sizeof(FrameHeader) + header.length;
+            if (conn.readBuffer.size() - offset < frameLength)
+            {
+                break;
+            }
+            
+            if (system_status == NORMAL)
+            {
+                Packet packet = Packet::createFromRawData(conn.readBuffer.data() + offset, conn.socket, (int) frameLength);
+                bool queued = inputBuffer.push(packet);
+                if (!queued)
+                {
+                    // Make room by decoding what is already queued
+                    processInput();
+                    queued = inputBuffer.push(packet);
+                }
+                
+                if (!queued)
+                {
+                    // Leave the rest in the read buffer until there is room
+                    packet.release();
+                    inputStalled = true;
+                    break;
+                }
+            }
+            
+            offset += frameLength;
+        }
+        
+        conn.readBuffer.erase(0, offset);
+        return true;
+    }
+    
+    // Read everything available, then decode all complete frames
+    void recieveDataFromSocket(Connection & conn, char * buffer)
+    {
+        bool open = true;
+        
+        while (open)
+        {
+            ssize_t bytesRecieved = recv(conn.socket, buffer, RECIEVE_BUFFER_SIZE, 0);
+            if (bytesRecieved > 0)
+            {
+                conn.readBuffer.append(buffer, bytesRecieved);
+                totalBytesRecieved.fetch_add(bytesRecieved, memory_order_relaxed);
+            }
+            else if (bytesRecieved < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (bytesRecieved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            else
+            {
+                open = false;
+            }
+        }
+        
+        if (!decodeFrames(conn))
+        {
+            open = false;
+        }
+        processInput();
+        
+        if (!open)
+        {
+            dropConnection(conn);
+        }
+    }
+    
+    // Function to start thread C
+    static void *reactorThreadCaller(void * context)
+    {
+        return ((CommunicationSubstrate *)context)->runReactor(NULL);
+    }
+    
+    // Threaded function to wait on socket readiness and outgoing traffic
+    void * runReactor(void *)
+    {
+        char * buffer = new char[RECIEVE_BUFFER_SIZE];
+        epoll_event events[16];
+        
+        while (system_status != FINISHED)
+        {
+            int eventCount = epoll_wait(epollFd, events, 16, -1);
+            
+            for (int i = 0;i < eventCount;i ++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == wakeFd)
+                {
+                    uint64_t wakeups;
+                    read(wakeFd, &wakeups, sizeof(wakeups));
+                    processOutput();
+                    if (inputStalled)
+                    {
+                        resumeInput();
+                    }
+                    continue;
+                }
+                
+                map<int, Connection>::iterator it = connections.find(fd);
+                if (it == connections.end())
+                {
+                    continue;
+                }
+                
+                if (events[i].events & EPOLLOUT)
+                {
+                    flushConnection(it->second);
+                }
+                
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                {
+                    recieveDataFromSocket(it->second, buffer);
+                }
+            }
+        }
+        
+        delete [] buffer;
+        pthread_exit(NULL);
+    }
+    
+    void wakeReactor()
+    {
+        uint64_t wakeup = 1;
+        write(wakeFd, &wakeup, sizeof(wakeup));
+    }
+    
+    // Wait for the reactor to make room when the output buffer is full
+    void queuePacket(Packet p)
+    {
+        while (!outputBuffer.push(p))
+        {
+            wakeReactor();
+            outputBuffer.waitForSpace(10);
+        }
+    }
+    
+    void startSubstrate()
+    {
+        cout << "Starting communication substrate..." << endl;
+        
+        if (int s = pthread_create(&reactorThread, NULL, &CommunicationSubstrate::reactorThreadCaller, this))
+        {
+            cout << "Error creating reactor thread. Code - " << s << endl;
+            exit(1);
+        }
+        
+        cout << "Communication substrate started." << endl;
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    CommunicationSubstrate(vector<ParticipantAddress> & participants) :
+        inputBuffer(RING_CAPACITY), outputBuffer(RING_CAPACITY), responseBuffer(RING_CAPACITY)
+    {
+        inputStalled = false;
+        
+        epollFd = epoll_create1(0);
+        wakeFd = eventfd(0, EFD_NONBLOCK);
+        
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = wakeFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+        
+        connectToParticipants(participants);
+        
+        startSubstrate();
+    }
+    
+    bool sendRequest(BookingRequest & req, vector<int> & sockets)
+    {
+        cout << "Sending request " << req.id << endl;
+        
+        if (sockets.empty())
+        {
+            return false;
+        }
+        
+        // Every participant gets the same frame
+        Packet p = req.getPacket(sockets[0], MSG_PREPARE);
+        for (int i = 1;i < sockets.size();i ++)
+        {
+            queuePacket(p.share(sockets[i]));
+        }
+        queuePacket(p);
+        wakeReactor();
+        
+        return true;
+    }
+    
+    // Prepare several requests with one frame per participant, holding
+    // only the requests that touch it
+    bool sendRequests(vector<BookingRequest> & batch)
+    {
+        cout << "Sending " << batch.size() << " requests from " << batch[0].id << endl;
+        
+        map<int, vector<BookingRequest> > parts;
+        for (int i = 0;i < batch.size();i ++)
+        {
+            vector<int> involved = socketsFor(batch[i]);
+            for (int j = 0;j < involved.size();j ++)
+            {
+                parts[involved[j]].push_back(batch[i]);
+            }
+        }
+        
+        for (map<int, vector<BookingRequest> >::iterator it = parts.begin();it != parts.end();it ++)
+        {
+            queuePacket(BookingRequest::createBatchPacket(it->first, it->second));
+        }
+        wakeReactor();
+        
+        return true;
+    }
+    
+    // Ask the only participant a booking touches to decide it on its own
+    bool sendOnePhase(BookingRequest & req, int socket, int record, int lowWater)
+    {
+        cout << "Sending one phase request " << req.id << " to " << participantName(socket) << endl;
+        
+        queuePacket(req.createOnePhasePacket(socket, record, lowWater));
+        wakeReactor();
+        
+        return true;
+    }
+    
+    // Number of wakes so far. Read it before checking for work, and pass
+    // it to waitForResponse so a wake in between is not slept through.
+    uint64_t wakeCount()
+    {
+        return responseBuffer.wakeCount();
+    }
+    
+    // Wake a thread blocked in waitForResponse
+    void wake()
+    {
+        responseBuffer.wake();
+    }
+    
+    // Block until a response is queued, wake is called after wakeCount was
+    // read, or timeoutMs passes
+    void waitForResponse(int timeoutMs, uint64_t wakeCount)
+    {
+        responseBuffer.waitForItems(timeoutMs, wakeCount);
+    }
+    
+    // Take the next decoded response, if any, without blocking
+    bool pollResponse(Response & res)
+    {
+        bool found = responseBuffer.pop(res);
+        if (found && inputStalled)
+        {
+            // The reactor is waiting for room to decode more
+            wakeReactor();
+        }
+        
+        return found;
+    }
+    
+    int socketFor(string name)
+    {
+        map<string, int>::iterator it = socketsByName.find(name);
+        return (it == socketsByName.end() ? -1 : it->second);
+    }
+    
+    // Queue depths, safe to read from any thread
+    size_t inputQueued()
+    {
+        return inputBuffer.size();
+    }
+    
+    size_t outputQueued()
+    {
+        return outputBuffer.size();
+    }
+    
+    size_t responsesQueued()
+    {
+        return responseBuffer.size();
+    }
+    
+    uint64_t getBytesSent()
+    {
+        return totalBytesSent.load(memory_order_relaxed);
+    }
+    
+    uint64_t getBytesRecieved()
+    {
+        return totalBytesRecieved.load(memory_order_relaxed);
+    }
+    
+    string participantName(int socket)
+    {
+        map<int, Connection>::iterator it = connections.find(socket);
+        return (it == connections.end() ? "unknown" : it->second.name);
+    }
+    
+    // Sockets of the participants a booking touches
+    vector<int> socketsFor(BookingRequest & req)
+    {
+        if (req.participants.empty())
+        {
+            return participantSockets;
+        }
+        
+        vector<int> sockets;
+        for (int i = 0;i < req.participants.size();i ++)
+        {
+            map<string, int>::iterator it = socketsByName.find(req.participants[i]);
+            if (it == socketsByName.end())
+            {
+                cout << "Ignoring unknown participant " << req.participants[i] << " in request " << req.id << endl;
+            }
+            else if (find(sockets.begin(), sockets.end(), it->second) == sockets.end())
+            {
+                sockets.push_back(it->second);
+            }
+        }
+        return sockets;
+    }
+    
+    bool sendAction(BookingRequest & req, set<int> & sockets, ActionType action, bool ackRequired)
+    {
+        cout << "Sending " << (action == COMMIT ? "Commit " : "Rollback ") << req.id << endl;
+        
+        if (sockets.empty())
+        {
+            return false;
+        }
+        
+        Packet p = req.createActionPacket(*sockets.begin(), action, ackRequired);
+        for (set<int>::iterator it = ++ sockets.begin();it != sockets.end();it ++)
+        {
+            queuePacket(p.share(*it));
+        }
+        queuePacket(p);
+        wakeReactor();
+        
+        return true;
+    }
+    
+    // Answer one participant's inquiry about an in-doubt transaction
+    void sendInquiryReply(int socket, int requestId, ActionType action, bool ackRequired)
+    {
+        cout << "Answering inquiry from " << participantName(socket) << " with " << (action == COMMIT ? "Commit " : "Rollback ") << requestId << endl;
+        
+        BookingRequest req;
+        req.id = requestId;
+        queuePacket(req.createActionPacket(socket, action, ackRequired));
+        wakeReactor();
+    }
+    
+    void stopSubstrate()
+    {
+        wakeReactor();
+        pthread_join(reactorThread, NULL);
+        
+        for (map<int, Connection>::iterator it = connections.begin();it != connections.end();it ++)
+        {
+            // Finish any backed up output, then the finish packet, blocking
+            // until the socket takes all of it
+            Connection & conn = it->second;
+            if (system_status == FINISHED)
+            {
+                Packet finishPacket = Packet::createFrame(conn.socket, MSG_FINISH, 0, 0);
+                conn.writeBuffer.append(finishPacket.data, finishPacket.length);
+                finishPacket.release();
+            }
+            fcntl(conn.socket, F_SETFL, fcntl(conn.socket, F_GETFL) & ~O_NONBLOCK);
+            flushConnection(conn);
+        }
+        
+        for (int i = 0;i < participantSockets.size();i ++)
+        {
+            close(participantSockets[i]);
+        }
+        close(wakeFd);
+        close(epollFd);
+    }
+    
+    void failSystem()
+    {
+        vector<Packet> packets;
+        outputBuffer.popBatch(packets, RING_CAPACITY);
+        inputBuffer.popBatch(packets, RING_CAPACITY);
+        for (int i = 0;i < packets.size();i ++)
+        {
+            packets[i].release();
+        }
+        
+        vector<Response> responses;
+        responseBuffer.popBatch(responses, RING_CAPACITY);
+        
+        cout << "Communication Substrate failed." << endl;
+    }
+};
+
+class DecisionLog
+{
+private:
+    
+    // ** Class Parameters **
+    
+    string filename;
+    int fd;
+    
+    pthread_t flushThread;
+    pthread_mutex_t lock;
+    pthread_cond_t pendingSignal;
+    
+    // Records appended since the last flush. Each record gets the next
+    // sequence number, and everything up to durableLsn is on disk.
+    string pending;
+    uint64_t appendedLsn = 0;
+    uint64_t durableLsn = 0;
+    
+    // A compaction waiting for the flush thread. The image replaces every
+    // record before compactOffset in pending and all those on disk.
+    bool compacting = false;
+    string compactImage;
+    size_t compactOffset = 0;
+    
+    // Microseconds a flush waits for more decisions to join it
+    int groupCommitWindow;
+    bool running;
+    
+    // Called from the flush thread each time more decisions are durable
+    void (*onDurable)(void *);
+    void * listener;
+    
+    LogMetrics * metrics = NULL;
+    
+    // ** Private Functions **
+    
+    static uint32_t recordChecksum(DecisionRecord record, const char * payload)
+    {
+        record.checksum = 0;
+        uint32_t hash = checksum((const char *)&record, sizeof(record), 2166136261u);
+        return checksum(payload, record.length, hash);
+    }
+    
+    static void encodeRecord(string & out, DecisionRecordType type, uint64_t transactionId, uint64_t lsn, const int * payload, int payloadInts)
+    {
+        DecisionRecord record;
+        record.type = type;
+        record.length = payloadInts * sizeof(int);
+        record.transactionId = transactionId;
+        record.lsn = lsn;
+        record.reserved = 0;
+        record.checksum = recordChecksum(record, (const char *)payload);
+        
+        out.append((const char *)&record, sizeof(record));
+        out.append((const char *)payload, record.length);
+    }
+    
+    // Write the compacted log next to the old one and swap it in. False if
+    // it could not be written, leaving the old log in place.
+    bool writeCompacted(string & image, const char * tail, size_t tailLength)
+    {
+        string tempName = filename + ".tmp";
+        int file = open(tempName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file == -1)
+        {
+            return false;
+        }
+        
+        int oldFd = fd;
+        fd = file;
+        bool written = writeAll(image.data(), image.size()) && writeAll(tail, tailLength);
+        written = written && (fdatasync(fd) == 0);
+        if (!written || rename(tempName.c_str(), filename.c_str()) != 0)
+        {
+            ::close(file);
+            fd = oldFd;
+            unlink(tempName.c_str());
+            return false;
+        }
+        ::close(oldFd);
+        
+        // Make the rename durable before relying on it
+        int dir = open(".", O_RDONLY);
+        fsync(dir);
+        ::close(dir);
+        
+        return true;
+    }
+    
+    // False if the log could not be written
+    bool writeAll(const char * data, size_t length)
+    {
+        size_t written = 0;
+        while (written < length)
+        {
+            ssize_t n = write(fd, data + written, length - written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            written += n;
+        }
+        
+        return true;
+    }
+    
+    // Function to start the log flush thread
+    static void * flushThreadCaller(void * context)
+    {
+        return ((DecisionLog *)context)->flushRecords(NULL);
+    }
+    
+    // Threaded function that writes and syncs every decision appended since
+    // the last flush, so one fdatasync covers all of them
+    void * flushRecords(void *)
+    {
+        pthread_mutex_lock(&lock);
+        while (running || !pending.empty())
+        {
+            if (pending.empty() && !compacting)
+            {
+                pthread_cond_wait(&pendingSignal, &lock);
+                continue;
+            }
+            
+            if (groupCommitWindow > 0 && running && !compacting)
+            {
+                pthread_mutex_unlock(&lock);
+                usleep(groupCommitWindow);
+                pthread_mutex_lock(&lock);
+                
+                if (pending.empty() && !compacting)
+                {
+                    // Discarded by close while waiting, none of it is durable
+                    continue;
+                }
+            }
+            
+            string batch;
+            swap(batch, pending);
+            uint64_t lsn = appendedLsn;
+            bool compact = compacting;
+            size_t split = (compact ? compactOffset : 0);
+            string image;
+            swap(image, compactImage);
+            compacting = false;
+            pthread_mutex_unlock(&lock);
+            
+            uint64_t flushStart = monotonicTime();
+            bool written = false;
+            if (compact)
+            {
+                // The image stands in for everything before the split
+                written = writeCompacted(image, batch.data() + split, batch.size() - split);
+                if (!written)
+                {
+                    cout << "Error - Could not compact " << filename << ", keeping it whole" << endl;
+                }
+            }
+            if (!written)
+            {
+                written = writeAll(batch.data(), batch.size()) && (fdatasync(fd) == 0);
+            }
+            
+            if (!written)
+            {
+                // Nothing past the last durable decision can be trusted, and
+                // a decision that was never durable must not be sent
+                cout << "Error - Could not write " << filename << " " << errno << endl;
+                exit(1);
+            }
+            
+            pthread_mutex_lock(&lock);
+            if (metrics != NULL)
+            {
+                metrics->flushTime.record((monotonicTime() - flushStart) / 1000);
+                metrics->flushRecords.record(lsn - durableLsn);
+            }
+            durableLsn = lsn;
+            if (onDurable != NULL)
+            {
+                onDurable(listener);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+        
+        pthread_exit(NULL);
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    DecisionLog(string logFilename, bool truncate, int window, void (*durableCallback)(void *), void * context)
+    {
+        filename = logFilename;
+        groupCommitWindow = window;
+        running = true;
+        onDurable = durableCallback;
+        listener = context;
+        
+        fd = open(filename.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+        if (fd == -1)
+        {
+            cout << "Error - Could not open " << filename << endl;
+            exit(1);
+        }
+        
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&pendingSignal, NULL);
+        
+        if (int s = pthread_create(&flushThread, NULL, &DecisionLog::flushThreadCaller, this))
+        {
+            cout << "Error creating decision log thread. Code - " << s << endl;
+            exit(1);
+        }
+    }
+    
+    // Record flush times in metrics. Set before anything is appended.
+    void setMetrics(LogMetrics * logMetrics)
+    {
+        pthread_mutex_lock(&lock);
+        metrics = logMetrics;
+        pthread_mutex_unlock(&lock);
+    }
+    
+    // Read back every intact record, oldest first, and cut off a torn tail.
+    // Only valid before anything new is appended.
+    vector<DecisionEntry> recover()
+    {
+        vector<DecisionEntry> entries;
+        
+        off_t size = lseek(fd, 0, SEEK_END);
+        string data(size, '\0');
+        if (size > 0 && pread(fd, &data[0], size, 0) != size)
+        {
+            cout << "Error - Could not read " << filename << endl;
+            exit(1);
+        }
+        
+        size_t offset = 0;
+        while (data.size() - offset >= sizeof(DecisionRecord))
+        {
+            DecisionRecord record;
+            memcpy(&record, data.data() + offset, sizeof(record));
+            
+            if (record.length % sizeof(int) != 0 || data.size() - offset - sizeof(DecisionRecord) < record.length)
+            {
+                break;
+            }
+            
+            const char * payload = data.data() + offset + sizeof(DecisionRecord);
+            if (recordChecksum(record, payload) != record.checksum)
+            {
+                break;
+            }
+            
+            DecisionEntry entry;
+            entry.type = DecisionRecordType(record.type);
+            entry.transactionId = record.transactionId;
+            entry.lsn = record.lsn;
+            entry.payload.resize(record.length / sizeof(int));
+            memcpy(entry.payload.data(), payload, record.length);
+            entries.push_back(entry);
+            
+            appendedLsn = max(appendedLsn, record.lsn);
+            offset += sizeof(DecisionRecord) + record.length;
+        }
+        
+        if (offset != data.size())
+        {
+            cout << "Discarding " << (data.size() - offset) << " bytes of torn decision log" << endl;
+            ftruncate(fd, offset);
+        }
+        lseek(fd, offset, SEEK_SET);
+        durableLsn = appendedLsn;
+        
+        return entries;
+    }
+    
+    // Queue a record for the next flush and return its sequence number
+    uint64_t append(DecisionRecordType type, uint64_t transactionId, const int * payload, int payloadInts)
+    {
+        pthread_mutex_lock(&lock);
+        uint64_t lsn = ++ appendedLsn;
+        encodeRecord(pending, type, transactionId, lsn, payload, payloadInts);
+        pthread_cond_signal(&pendingSignal);
+        pthread_mutex_unlock(&lock);
+        
+        return lsn;
+    }
+    
+    // Rewrite the log as just these records followed by whatever is
+    // appended from now on. They must include every decision appended so
+    // far that has no end record yet.
+    void compact(vector<DecisionEntry> & live)
+    {
+        string image;
+        for (int i = 0;i < live.size();i ++)
+        {
+            DecisionEntry & entry = live[i];
+            encodeRecord(image, entry.type, entry.transactionId, entry.lsn, entry.payload.data(), (int) entry.payload.size());
+        }
+        
+        pthread_mutex_lock(&lock);
+        swap(compactImage, image);
+        compactOffset = pending.size();
+        compacting = true;
+        pthread_cond_signal(&pendingSignal);
+        pthread_mutex_unlock(&lock);
+    }
+    
+    uint64_t getAppendedLsn()
+    {
+        pthread_mutex_lock(&lock);
+        uint64_t lsn = appendedLsn;
+        pthread_mutex_unlock(&lock);
+        return lsn;
+    }
+    
+    uint64_t getDurableLsn()
+    {
+        pthread_mutex_lock(&lock);
+        uint64_t lsn = durableLsn;
+        pthread_mutex_unlock(&lock);
+        return lsn;
+    }
+    
+    // Stop the flush thread, writing out pending records unless the
+    // process is simulating a crash
+    void close(bool flush)
+    {
+        pthread_mutex_lock(&lock);
+        if (!flush)
+        {
+            pending.clear();
+            compacting = false;
+        }
+        running = false;
+        pthread_cond_signal(&pendingSignal);
+        pthread_mutex_unlock(&lock);
+        
+        pthread_join(flushThread, NULL);
+        ::close(fd);
+    }
+};
+
+// Streams bookings out of the booking file on its own thread. The file is
+// mapped rather than read into memory, each line is parsed in place, and
+// parsed bookings wait in a bounded queue until the coordinator takes them,
+// so transactions start while the rest of the file is still being read.
+class BookingReader
+{
+private:
+    
+    // ** Class Parameters **
+    
+    string filename;
+    int fd = -1;
+    const char * data = NULL;
+    size_t length = 0;
+    
+    // Bookings parsed ahead of the coordinator, in file order
+    RingBuffer<BookingRequest> parsed;
+    
+    // Where reading starts, and the records from there that were already
+    // finished before a failure, skipped without parsing
+    uint64_t startOffset = 0;
+    int startRecord = 0;
+    int skipRecords = 0;
+    
+    pthread_t readerThread;
+    atomic<bool> finished;
+    atomic<bool> stopping;
+    
+    // Called from the reader thread when a booking is queued or the file
+    // runs out
+    void (*onParsed)(void *);
+    void * listener;
+    
+    // Binary files are read in place by the coordinator thread, with no
+    // reader thread or queue
+    bool binary = false;
+    const BookingRecord * records = NULL;
+    const int32_t * listDates = NULL;
+    uint64_t recordsOffset = 0;
+    uint64_t recordCount = 0;
+    uint64_t listDateCount = 0;
+    uint64_t nextRecord = 0;
+    vector<string> names;
+    
+    // ** Private Functions **
+    
+    // Check a binary file's header and sections against the mapped length
+    void openBinary()
+    {
+        BookingFileHeader header;
+        memcpy(&header, data, sizeof(header));
+        
+        if (header.version != BOOKING_FILE_VERSION || header.recordSize != sizeof(BookingRecord))
+        {
+            cout << "Error - Unsupported booking file version " << header.version << " in " << filename << endl;
+            exit(1);
+        }
+        
+        if (header.recordsOffset % sizeof(int64_t) != 0 || header.recordsOffset > length ||
+            header.recordCount > (length - header.recordsOffset) / sizeof(BookingRecord) ||
+            header.datesOffset % sizeof(int32_t) != 0 || header.datesOffset > length ||
+            header.dateCount > (length - header.datesOffset) / sizeof(int32_t) ||
+            header.nameCount > MAX_BOOKING_NAMES || header.namesOffset > length ||
+            header.nameCount > (length - header.namesOffset) / BOOKING_NAME_LENGTH)
+        {
+            cout << "Error - Corrupt booking file header in " << filename << endl;
+            exit(1);
+        }
+        
+        binary = true;
+        records = (const BookingRecord *)(data + header.recordsOffset);
+        recordsOffset = header.recordsOffset;
+        recordCount = header.recordCount;
+        listDates = (const int32_t *)(data + header.datesOffset);
+        listDateCount = header.dateCount;
+        
+        for (int i = 0;i < header.nameCount;i ++)
+        {
+            const char * name = data + header.namesOffset + i * BOOKING_NAME_LENGTH;
+            names.push_back(string(name, strnlen(name, BOOKING_NAME_LENGTH)));
+        }
+    }
+    
+    // Expand a binary record into req
+    void decodeRecord(uint64_t index, BookingRequest & req)
+    {
+        const BookingRecord & record = records[index];
+        const uint64_t maxDates = MAX_FRAME_PAYLOAD / sizeof(int) - 2;
+        
+        req.id = record.id;
+        req.tickets = record.tickets;
+        req.nextOffset = recordsOffset + (index + 1) * sizeof(BookingRecord);
+        req.dates.clear();
+        req.participants.clear();
+        
+        uint32_t known = (names.size() == 32 ? 0xFFFFFFFFU : (1U << names.size()) - 1);
+        bool valid = (record.participants & ~known) == 0;
+        if (record.kind == DATES_RANGE && valid && record.dates <= maxDates)
+        {
+            for (uint64_t i = 0;i < record.dates;i ++)
+            {
+                req.dates.push_back((int)(record.first + i));
+            }
+        }
+        else if (record.kind == DATES_BITMAP && valid)
+        {
+            for (int i = 0;i < 64;i ++)
+            {
+                if (record.dates & (1ULL << i))
+                {
+                    req.dates.push_back((int)(record.first + i));
+                }
+            }
+        }
+        else if (record.kind == DATES_LIST && valid && record.first >= 0 &&
+                 (uint64_t) record.first <= listDateCount && record.dates <= listDateCount - record.first &&
+                 record.dates <= maxDates)
+        {
+            req.dates.assign(listDates + record.first, listDates + record.first + record.dates);
+        }
+        else
+        {
+            cout << "Error - Malformed booking record " << index << " of " << filename << endl;
+            exit(1);
+        }
+        
+        for (int i = 0;i < names.size();i ++)
+        {
+            if (record.participants & (1U << i))
+            {
+                req.participants.push_back(names[i]);
+            }
+        }
+    }
+    
+    static bool isSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+    
+    static void skipSpace(const char *& p, const char * end)
+    {
+        while (p < end && isSpace(*p))
+        {
+            p ++;
+        }
+    }
+    
+    static bool isBlank(const char * p, const char * end)
+    {
+        skipSpace(p, end);
+        return p == end;
+    }
+    
+    static bool isDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+    
+    // Whether a possibly negative number starts at p
+    static bool startsNumber(const char * p, const char * end)
+    {
+        return p < end && (isDigit(*p) || (*p == '-' && p + 1 < end && isDigit(p[1])));
+    }
+    
+    // Read a possibly negative number with any number of digits, false if
+    // there is none or it does not fit in an int
+    static bool parseNumber(const char *& p, const char * end, int & value)
+    {
+        bool negative = (p < end && *p == '-');
+        const char * digits = (negative ? p + 1 : p);
+        int64_t limit = (int64_t) INT32_MAX + (negative ? 1 : 0);
+        
+        int64_t number = 0;
+        const char * q = digits;
+        while (q < end && isDigit(*q))
+        {
+            number = number * 10 + (*q - '0');
+            if (number > limit)
+            {
+                return false;
+            }
+            q ++;
+        }
+        
+        if (q == digits)
+        {
+            return false;
+        }
+        
+        value = (int)(negative ? -number : number);
+        p = q;
+        return true;
+    }
+    
+    // Parse "id tickets [dates] names..." into req, false if the id or
+    // tickets are missing or any number is too large
+    static bool parseLine(const char * p, const char * end, BookingRequest & req)
+    {
+        req.dates.clear();
+        req.participants.clear();
+        
+        skipSpace(p, end);
+        if (!parseNumber(p, end, req.id))
+        {
+            return false;
+        }
+        
+        skipSpace(p, end);
+        if (!parseNumber(p, end, req.tickets))
+        {
+            return false;
+        }
+        
+        // Dates run up to the closing bracket, names come after it
+        bool inDates = true;
+        while (true)
+        {
+            skipSpace(p, end);
+            if (p == end)
+            {
+                break;
+            }
+            
+            int date;
+            if (inDates && *p == '[')
+            {
+                p ++;
+            }
+            else if (inDates && *p == ']')
+            {
+                p ++;
+                inDates = false;
+            }
+            else if (inDates && startsNumber(p, end))
+            {
+                if (!parseNumber(p, end, date))
+                {
+                    return false;
+                }
+                req.dates.push_back(date);
+            }
+            else
+            {
+                inDates = false;
+                
+                const char * name = p;
+                while (p < end && !isSpace(*p))
+                {
+                    p ++;
+                }
+                req.participants.push_back(string(name, p - name));
+            }
+        }
+        
+        return true;
+    }
+    
+    // True if offset is where record skip starts and the record before it
+    // is booking previousId, so a restart can begin there
+    bool canResumeAt(int skip, uint64_t offset, int previousId)
+    {
+        if (skip == 0 || offset == 0)
+        {
+            return skip == 0 && offset == 0;
+        }
+        
+        if (binary)
+        {
+            return offset >= recordsOffset && (offset - recordsOffset) % sizeof(BookingRecord) == 0 &&
+                   (offset - recordsOffset) / sizeof(BookingRecord) == (uint64_t) skip &&
+                   (uint64_t) skip <= recordCount && records[skip - 1].id == previousId;
+        }
+        
+        // Only the last line may end without a newline
+        if (offset > length || (data[offset - 1] != '\n' && offset != length))
+        {
+            return false;
+        }
+        
+        // Walk back over blank lines to the previous record
+        const char * lineEnd = data + offset - (data[offset - 1] == '\n' ? 1 : 0);
+        while (true)
+        {
+            const char * lineStart = lineEnd;
+            while (lineStart > data && lineStart[-1] != '\n')
+            {
+                lineStart --;
+            }
+            
+            if (!isBlank(lineStart, lineEnd))
+            {
+                int id;
+                skipSpace(lineStart, lineEnd);
+                return parseNumber(lineStart, lineEnd, id) && id == previousId;
+            }
+            
+            if (lineStart == data)
+            {
+                return false;
+            }
+            lineEnd = lineStart - 1;
+        }
+    }
+    
+    void notifyListener()
+    {
+        if (onParsed != NULL)
+        {
+            onParsed(listener);
+        }
+    }
+    
+    static void * readerThreadCaller(void * context)
+    {
+        return ((BookingReader *)context)->runReader(NULL);
+    }
+    
+    // Threaded function to parse the file a line at a time into the queue
+    void * runReader(void *)
+    {
+        const char * p = data + startOffset;
+        const char * end = data + length;
+        int record = startRecord;
+        BookingRequest req;
+        
+        while (p < end && !stopping)
+        {
+            const char * lineEnd = (const char *)memchr(p, '\n', end - p);
+            if (lineEnd == NULL)
+            {
+                lineEnd = end;
+            }
+            
+            // Blank lines are not records
+            if (!isBlank(p, lineEnd))
+            {
+                if (record >= skipRecords)
+                {
+                    if (!parseLine(p, lineEnd, req))
+                    {
+                        cout << "Error - Malformed booking " << record + 1 << " at byte " << p - data << " of " << filename << endl;
+                        exit(1);
+                    }
+                    req.nextOffset = min((uint64_t)(lineEnd + 1 - data), (uint64_t) length);
+                    
+                    while (!parsed.push(req) && !stopping)
+                    {
+                        parsed.waitForSpace(10);
+                    }
+                    notifyListener();
+                }
+                record ++;
+            }
+            
+            p = lineEnd + 1;
+        }
+        
+        finished = true;
+        notifyListener();
+        pthread_exit(NULL);
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    BookingReader(string bookingFile, void (*parsedCallback)(void *), void * context) : parsed(INGEST_QUEUE_CAPACITY)
+    {
+        filename = bookingFile;
+        finished = false;
+        stopping = false;
+        onParsed = parsedCallback;
+        listener = context;
+        
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            cout << "Error - Could not open " << filename << endl;
+            exit(1);
+        }
+        
+        length = (size_t) lseek(fd, 0, SEEK_END);
+        if (length > 0)
+        {
+            void * mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                cout << "Error - Could not map " << filename << " " << errno << endl;
+                exit(1);
+            }
+            madvise(mapping, length, MADV_SEQUENTIAL);
+            data = (const char *) mapping;
+        }
+        
+        if (length >= sizeof(BookingFileHeader) && memcmp(data, BOOKING_FILE_MAGIC, sizeof(BOOKING_FILE_MAGIC)) == 0)
+        {
+            openBinary();
+        }
+    }
+    
+    // Start parsing after the first skip records. Offset is where record
+    // skip begins and previousId the booking before it, as saved by an
+    // earlier run. If they no longer match the file the skipped records are
+    // counted from the start instead.
+    void start(int skip, uint64_t offset, int previousId)
+    {
+        skipRecords = skip;
+        if (canResumeAt(skip, offset, previousId))
+        {
+            startOffset = offset;
+            startRecord = skip;
+        }
+        else
+        {
+            cout << "Booking file does not match the saved offset, counting " << skip << " records" << endl;
+        }
+        
+        if (binary)
+        {
+            nextRecord = min((uint64_t) skip, recordCount);
+            finished = true;
+            return;
+        }
+        
+        if (int s = pthread_create(&readerThread, NULL, &BookingReader::readerThreadCaller, this))
+        {
+            cout << "Error creating reader thread. Code - " << s << endl;
+            exit(1);
+        }
+    }
+    
+    // Take the next booking if one has been parsed
+    bool next(BookingRequest & req)
+    {
+        if (binary)
+        {
+            if (nextRecord == recordCount)
+            {
+                return false;
+            }
+            
+            decodeRecord(nextRecord ++, req);
+            return true;
+        }
+        
+        return parsed.pop(req);
+    }
+    
+    // Wait up to timeoutMs for the reader to parse another booking
+    void waitForBookings(int timeoutMs)
+    {
+        if (!binary)
+        {
+            parsed.waitForItems(timeoutMs);
+        }
+    }
+    
+    // Bookings parsed and waiting to be taken
+    size_t queued()
+    {
+        return (binary ? 0 : parsed.size());
+    }
+    
+    // False once the whole file is read and every booking taken
+    bool hasMore()
+    {
+        if (binary)
+        {
+            return nextRecord < recordCount;
+        }
+        
+        return !finished || !parsed.empty();
+    }
+    
+    // Stop reading and release the file
+    void stop()
+    {
+        stopping = true;
+        if (!binary)
+        {
+            pthread_join(readerThread, NULL);
+        }
+        
+        if (data != NULL)
+        {
+            munmap((void *) data, length);
+            data = NULL;
+        }
+        ::close(fd);
+    }
+};
+
+// Writes bookings to a binary booking file, for the --convert mode
+class BookingWriter
+{
+private:
+    
+    // ** Class Parameters **
+    
+    string filename;
+    ofstream file;
+    BookingFileHeader header;
+    
+    // Date lists that fit neither a range nor a bitmap, written after the
+    // records
+    vector<int32_t> listDates;
+    vector<string> names;
+    
+    // ** Private Functions **
+    
+    uint32_t participantMask(vector<string> & participants)
+    {
+        uint32_t mask = 0;
+        for (int i = 0;i < participants.size();i ++)
+        {
+            int index = (int)(find(names.begin(), names.end(), participants[i]) - names.begin());
+            if (index == names.size())
+            {
+                if (names.size() == MAX_BOOKING_NAMES || participants[i].size() >= BOOKING_NAME_LENGTH)
+                {
+                    cout << "Error - Too many or too long participant names for " << filename << endl;
+                    exit(1);
+                }
+                names.push_back(participants[i]);
+            }
+            mask |= (1U << index);
+        }
+        return mask;
+    }
+    
+    // Pick the smallest date encoding that gives back the same dates in the
+    // same order
+    void encodeDates(BookingRequest & req, BookingRecord & record)
+    {
+        int count = (int) req.dates.size();
+        bool consecutive = true;
+        bool ascending = true;
+        for (int i = 1;i < count;i ++)
+        {
+            consecutive = consecutive && ((int64_t) req.dates[i] == (int64_t) req.dates[0] + i);
+            ascending = ascending && (req.dates[i] > req.dates[i - 1]);
+        }
+        
+        if (consecutive)
+        {
+            record.kind = DATES_RANGE;
+            record.first = (count > 0 ? req.dates[0] : 0);
+            record.dates = count;
+        }
+        else if (ascending && (int64_t) req.dates[count - 1] - req.dates[0] < 64)
+        {
+            record.kind = DATES_BITMAP;
+            record.first = req.dates[0];
+            record.dates = 0;
+            for (int i = 0;i < count;i ++)
+            {
+                record.dates |= 1ULL << (req.dates[i] - req.dates[0]);
+            }
+        }
+        else
+        {
+            record.kind = DATES_LIST;
+            record.first = (int64_t) listDates.size();
+            record.dates = count;
+            listDates.insert(listDates.end(), req.dates.begin(), req.dates.end());
+        }
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    BookingWriter(string binaryFile)
+    {
+        filename = binaryFile;
+        
+        file.open(filename.c_str(), ios::out | ios::binary | ios::trunc);
+        if (!file.is_open())
+        {
+            cout << "Error - Could not open " << filename << endl;
+            exit(1);
+        }
+        
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BOOKING_FILE_MAGIC, sizeof(BOOKING_FILE_MAGIC));
+        header.version = BOOKING_FILE_VERSION;
+        header.recordSize = sizeof(BookingRecord);
+        header.recordsOffset = sizeof(BookingFileHeader);
+        
+        // The header is written again with the counts once every record is in
+        file.write((const char *) &header, sizeof(header));
+    }
+    
+    void write(BookingRequest & req)
+    {
+        BookingRecord record;
+        memset(&record, 0, sizeof(record));
+        record.id = req.id;
+        record.tickets = req.tickets;
+        record.participants = participantMask(req.participants);
+        encodeDates(req, record);
+        
+        file.write((const char *) &record, sizeof(record));
+        header.recordCount ++;
+    }
+    
+    // Write the date lists, names and final header
+    void close()
+    {
+        header.datesOffset = header.recordsOffset + header.recordCount * sizeof(BookingRecord);
+        header.dateCount = listDates.size();
+        file.write((const char *) listDates.data(), listDates.size() * sizeof(int32_t));
+        
+        header.namesOffset = header.datesOffset + header.dateCount * sizeof(int32_t);
+        header.nameCount = (uint32_t) names.size();
+        for (int i = 0;i < names.size();i ++)
+        {
+            char name[BOOKING_NAME_LENGTH] = {0};
+            memcpy(name, names[i].data(), names[i].size());
+            file.write(name, BOOKING_NAME_LENGTH);
+        }
+        
+        file.seekp(0);
+        file.write((const char *) &header, sizeof(header));
+        file.close();
+        
+        if (file.fail())
+        {
+            cout << "Error - Could not write " << filename << endl;
+            exit(1);
+        }
+    }
+};
+
+class Coordinator
+{
+private:
+    
+    // ** Class Parameters **
+    
+    string configFile;
+    string bookingFile;
+    
+    vector<ParticipantAddress> participants;
+    
+    // Bookings come from the reader, with one held back while its id is
+    // still in flight
+    BookingReader * reader = NULL;
+    BookingRequest nextRequest;
+    bool haveNext = false;
+    
+    pthread_t processThread;
+    
+    CommunicationSubstrate * comm;
+    
+    map<int, Transaction> transactions;
+    
+    ofstream outputFile;
+    ofstream logfile;
+    
+    // One line per finished transaction with its phase times, if set
+    string latencyLogName = "";
+    ofstream latencyFile;
+    
+    int window = 1;
+    
+    // Prepares wait up to lingerTime ms to fill a batch of batchSize
+    int batchSize = 1;
+    int lingerTime = 0;
+    vector<BookingRequest> prepareBatch;
+    uint64_t batchStart = 0;
+    
+    // Every record before currentRecord is complete, plus any in
+    // completedRecords, each kept with the offset after it and its id
+    int currentRecord = 0;
+    int nextRecord = 0;
+    map<int, pair<uint64_t, int> > completedRecords;
+    
+    // Where the booking file resumes after currentRecord, and the booking
+    // just before that point, so a restart can seek straight there
+    uint64_t resumeOffset = 0;
+    int lastCompletedId = 0;
+    
+    // Decisions are only sent once their log record is durable
+    DecisionLog * decisionLog = NULL;
+    string decisionLogName = "decisions.log";
+    int groupCommitWindow = 0;
+    
+    // A fresh start only drops unacknowledged decisions when told to
+    bool discardDecisions = false;
+    
+    // Records appended between rewrites of the decision log down to the
+    // unacknowledged decisions, 0 to never rewrite it
+    int decisionLogCompact = 10000;
+    uint64_t compactedLsn = 0;
+    deque<int> awaitingDecisions;
+    
+    // Decisions found in the log on recovery, by booking file record
+    map<int, DecisionEntry> loggedDecisions;
+    
+    // Presumed abort never logs or acknowledges a rollback, and answers
+    // inquiries about unknown transactions with a rollback
+    bool presumedAbort = false;
+    
+    // Milliseconds to wait for votes, and for acknowledgements of a
+    // decision, before sending the phase again
+    TimerWheel<TransactionTimer> timers;
+    uint64_t timerSequence = 0;
+    int prepareTimeout = 10000;
+    int decisionTimeout = 10000;
+    
+    // Times a two phase transaction is prepared before the participants
+    // that never answered count as no votes, 0 to keep preparing
+    int prepareAttempts = 3;
+    
+    pthread_t statsThread;
+    CoordinatorMetrics metrics;
+    
+    // Prometheus text is served on this loopback port or Unix socket, if set
+    int metricsPort = 0;
+    string metricsSocket = "";
+    MetricsServer * metricsServer = NULL;
+    
+    // ** Private Functions **
+    
+    // Read lines from a given file
+    vector<string> readFile(string filename)
+    {
+        ifstream readFile (filename);
+        string line;
+        vector<string> lines;
+        if (readFile.is_open())
+        {
+            while (getline(readFile, line))
+            {
+                if (!line.empty() && line[line.length() - 1] == '\r')
+                {
+                    line.erase(line.length() - 1, 1);
+                }
+                lines.push_back(line);
+            }
+            readFile.close();
+        }
+        else
+        {
+            cout << "Error - Could not open " << filename << endl;
+            exit(1);
+        }
+        return lines;
+    }
+    
+    // Read parameters from config file
+    void readConfigFile()
+    {
+        vector<string> lines = readFile(configFile);
+        participants.clear();
+        
+        // Participant addresses come first, named hotel and concert for the
+        // original two-node layout, then the booking file
+        int i = 0;
+        for (;i < lines.size() && lines[i].find(' ') == string::npos;i ++)
+        {
+            if (lines[i].find(':') == string::npos)
+            {
+                bookingFile = lines[i ++];
+                break;
+            }
+            
+            ParticipantAddress participant;
+            participant.name = (i == 0 ? "hotel" : (i == 1 ? "concert" : "participant" + to_string(i + 1)));
+            participant.address = lines[i];
+            participants.push_back(participant);
+        }
+        
+        // Optional "name value" settings follow the booking file
+        for (;i < lines.size();i ++)
+        {
+            vector<string> option = split(lines[i], ' ');
+            if (option.size() < 2)
+            {
+                continue;
+            }
+            
+            if (option[0] == "participant" && option.size() >= 3)
+            {
+                ParticipantAddress participant;
+                participant.name = option[1];
+                participant.address = option[2];
+                participants.push_back(participant);
+            }
+            else if (option[0] == "window")
+            {
+                window = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "batch")
+            {
+                batchSize = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "linger")
+            {
+                lingerTime = max(0, stoi(option[1]));
+            }
+            else if (option[0] == "decision_log")
+            {
+                decisionLogName = option[1];
+            }
+            else if (option[0] == "group_commit")
+            {
+                groupCommitWindow = max(0, stoi(option[1]));
+            }
+            else if (option[0] == "discard_decisions")
+            {
+                discardDecisions = (option[1] == "yes");
+            }
+            else if (option[0] == "decision_log_compact")
+            {
+                decisionLogCompact = max(0, stoi(option[1]));
+            }
+            else if (option[0] == "latency_log")
+            {
+                latencyLogName = option[1];
+            }
+            else if (option[0] == "prepare_timeout")
+            {
+                prepareTimeout = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "decision_timeout")
+            {
+                decisionTimeout = max(1, stoi(option[1]));
+            }
+            else if (option[0] == "prepare_attempts")
+            {
+                prepareAttempts = max(0, stoi(option[1]));
+            }
+            else if (option[0] == "protocol")
+            {
+                presumedAbort = (option[1] == "presumed_abort");
+            }
+            else if (option[0] == "metrics_port")
+            {
+                metricsPort = max(0, stoi(option[1]));
+            }
+            else if (option[0] == "metrics_socket")
+            {
+                metricsSocket = option[1];
+            }
+        }
+    }
+    
+    // Whether any booking is left to start
+    bool requestsLeft()
+    {
+        return haveNext || reader->hasMore();
+    }
+    
+    // Start the deadline for the transaction's current phase
+    void armTimer(Transaction & txn, int timeout)
+    {
+        TransactionTimer timer;
+        timer.id = txn.request.id;
+        timer.sequence = ++ timerSequence;
+        txn.timer = timer.sequence;
+        timers.schedule(timer, TimerWheel<TransactionTimer>::now() + timeout);
+    }
+    
+    // Send (or resend) the prepare phase of a transaction
+    void beginPrepare(Transaction & txn)
+    {
+        txn.state = PREPARED;
+        txn.decisionLsn = 0;
+        txn.votes.clear();
+        txn.phaseTwo.clear();
+        txn.acks.clear();
+        txn.preparedAt = monotonicTime();
+        armTimer(txn, prepareTimeout);
+        
+        if (txn.onePhase)
+        {
+            comm->sendOnePhase(txn.request, txn.participants[0], txn.record, currentRecord);
+            return;
+        }
+        
+        if (batchSize == 1)
+        {
+            comm->sendRequest(txn.request, txn.participants);
+            return;
+        }
+        
+        if (prepareBatch.empty())
+        {
+            batchStart = monotonicTime();
+        }
+        prepareBatch.push_back(txn.request);
+        
+        if (prepareBatch.size() >= batchSize)
+        {
+            flushPrepareBatch();
+        }
+    }
+    
+    void flushPrepareBatch()
+    {
+        if (!prepareBatch.empty())
+        {
+            uint64_t now = monotonicTime();
+            metrics.batchWait.record((now - batchStart) / 1000);
+            for (int i = 0;i < prepareBatch.size();i ++)
+            {
+                transactions[prepareBatch[i].id].preparedAt = now;
+            }
+            
+            comm->sendRequests(prepareBatch);
+            prepareBatch.clear();
+        }
+    }
+    
+    // Send a partial batch once nothing more can join it or it has lingered too long
+    void checkPrepareBatch()
+    {
+        if (prepareBatch.empty())
+        {
+            return;
+        }
+        
+        // While the file is still being read more bookings may yet join,
+        // so only the window or the linger time end the batch
+        bool windowFull = (transactions.size() >= window || !requestsLeft());
+        if (windowFull || monotonicTime() - batchStart >= (uint64_t)lingerTime * 1000000)
+        {
+            flushPrepareBatch();
+        }
+    }
+    
+    // Start new transactions until the window is full
+    void fillWindow()
+    {
+        while (transactions.size() < window)
+        {
+            if (!haveNext && !reader->next(nextRequest))
+            {
+                break;
+            }
+            haveNext = true;
+            
+            if (transactions.count(nextRequest.id))
+            {
+                // A booking id is only in flight once at a time
+                break;
+            }
+            
+            int record = nextRecord;
+            nextRecord ++;
+            haveNext = false;
+            
+            if (completedRecords.count(record))
+            {
+                // Finished before the last failure
+                continue;
+            }
+            
+            Transaction & txn = transactions[nextRequest.id];
+            txn.request = move(nextRequest);
+            
+            BookingRequest & req = txn.request;
+            txn.record = record;
+            txn.participants = comm->socketsFor(req);
+            txn.onePhase = (txn.participants.size() == 1);
+            txn.decision = ROLLBACK;
+            txn.prepareTimeouts = 0;
+            txn.startedAt = txn.preparedAt = txn.votedAt = txn.decidedAt = monotonicTime();
+            
+            map<int, DecisionEntry>::iterator logged = loggedDecisions.find(record);
+            if (logged != loggedDecisions.end())
+            {
+                // Decided before the last failure, finish phase 2 only. The
+                // yes voters are not logged, so every participant is told.
+                txn.decision = (logged->second.type == LOG_COMMIT ? COMMIT : ROLLBACK);
+                txn.decisionLsn = logged->second.lsn;
+                txn.phaseTwo = set<int>(txn.participants.begin(), txn.participants.end());
+                txn.state = DECIDED;
+                armTimer(txn, decisionTimeout);
+                loggedDecisions.erase(logged);
+                cout << "Resending logged decision for " << req.id << endl;
+                comm->sendAction(txn.request, txn.phaseTwo, txn.decision, true);
+                continue;
+            }
+            
+            if (txn.participants.empty())
+            {
+                cout << "Request " << req.id << " touches no participants" << endl;
+                outputFile << req.id << " Fail" << endl;
+                completeTransaction(transactions.find(req.id));
+                continue;
+            }
+            
+            beginPrepare(txn);
+        }
+    }
+    
+    // All votes are in, log the decision. It is sent once the log is durable.
+    void decide(Transaction & txn)
+    {
+        txn.state = VOTED;
+        txn.votedAt = txn.decidedAt = monotonicTime();
+        txn.decision = COMMIT;
+        for (map<int, VoteStatus>::iterator it = txn.votes.begin();it != txn.votes.end();it ++)
+        {
+            if (it->second == VOTE_NO)
+            {
+                txn.decision = ROLLBACK;
+            }
+            else if (it->second == VOTE_YES)
+            {
+                txn.phaseTwo.insert(it->first);
+            }
+        }
+        
+        if (!txn.onePhase && txn.decision == ROLLBACK)
+        {
+            // A no vote may be left over from an earlier prepare of this id,
+            // sent before the participant voted yes on a later one. No voters
+            // are told as well, without waiting on them, and any that missed
+            // it are answered with a rollback when they inquire.
+            set<int> noVoters;
+            for (map<int, VoteStatus>::iterator it = txn.votes.begin();it != txn.votes.end();it ++)
+            {
+                if (it->second == VOTE_NO && !txn.phaseTwo.count(it->first))
+                {
+                    noVoters.insert(it->first);
+                }
+            }
+            if (!noVoters.empty())
+            {
+                comm->sendAction(txn.request, noVoters, ROLLBACK, false);
+            }
+        }
+        
+        if (txn.onePhase || txn.phaseTwo.empty())
+        {
+            // The participant already decided, or nobody holds anything
+            // prepared, so there is nothing to log or send
+            txn.state = DECIDED;
+            cout << "Finished " << txn.request.id << (txn.onePhase ? " in one phase" : " without phase 2") << endl;
+            outputFile << txn.request.id << (txn.decision == COMMIT ? " Success" : " Fail") << endl;
+            completeTransaction(transactions.find(txn.request.id));
+            return;
+        }
+        
+        if (presumedAbort && txn.decision == ROLLBACK)
+        {
+            // Nothing to force, and participants do not acknowledge
+            txn.state = DECIDED;
+            comm->sendAction(txn.request, txn.phaseTwo, ROLLBACK, false);
+            outputFile << txn.request.id << " Fail" << endl;
+            completeTransaction(transactions.find(txn.request.id));
+            return;
+        }
+        
+        int record = txn.record;
+        txn.decisionLsn = decisionLog->append(txn.decision == COMMIT ? LOG_COMMIT : LOG_ROLLBACK, txn.request.id, &record, 1);
+        awaitingDecisions.push_back(txn.request.id);
+    }
+    
+    // Send every decision whose log record has reached the disk
+    void releaseDecisions()
+    {
+        if (awaitingDecisions.empty())
+        {
+            return;
+        }
+        
+        uint64_t durableLsn = decisionLog->getDurableLsn();
+        while (!awaitingDecisions.empty())
+        {
+            Transaction & txn = transactions[awaitingDecisions.front()];
+            if (txn.decisionLsn > durableLsn)
+            {
+                break;
+            }
+            awaitingDecisions.pop_front();
+            
+            txn.state = DECIDED;
+            txn.decidedAt = monotonicTime();
+            armTimer(txn, decisionTimeout);
+            comm->sendAction(txn.request, txn.phaseTwo, txn.decision, true);
+            outputFile << txn.request.id << (txn.decision == COMMIT ? " Success" : " Fail") << endl;
+        }
+    }
+    
+    // Start a new decision log, unless the old one still holds decisions
+    // that participants may need to settle their prepared requests
+    void openFreshDecisionLog()
+    {
+        decisionLog = new DecisionLog(decisionLogName, false, groupCommitWindow, &Coordinator::wakeCaller, this);
+        recoverDecisions();
+        if (!loggedDecisions.empty() && !discardDecisions)
+        {
+            cout << "Error - " << decisionLogName << " holds " << loggedDecisions.size() << " unacknowledged decisions. Recover, or set discard_decisions yes to drop them." << endl;
+            exit(1);
+        }
+        else if (!loggedDecisions.empty())
+        {
+            cout << "Discarding " << loggedDecisions.size() << " unacknowledged decisions" << endl;
+        }
         
-        startSubstrate();
+        loggedDecisions.clear();
+        decisionLog->close(true);
+        delete decisionLog;
+        decisionLog = new DecisionLog(decisionLogName, true, groupCommitWindow, &Coordinator::wakeCaller, this);
     }
     
-    bool sendRequest(BookingRequest req)
+    // Rewrite the decision log as the decisions still missing an end
+    // record, so a restart reads those and the records since instead of
+    // the whole history
+    void compactDecisionLog()
     {
-        cout << "Sending request " << req.id << endl;
-        
-        Packet hotelPacket = req.getPacket(hotelSocket);
-        Packet concertPacket = req.getPacket(concertSocket);
+        vector<DecisionEntry> live;
+        for (map<int, DecisionEntry>::iterator it = loggedDecisions.begin();it != loggedDecisions.end();it ++)
+        {
+            live.push_back(it->second);
+        }
         
-        outputBuffer.push(hotelPacket);
-        outputBuffer.push(concertPacket);
+        for (map<int, Transaction>::iterator it = transactions.begin();it != transactions.end();it ++)
+        {
+            Transaction & txn = it->second;
+            if (txn.decisionLsn != 0)
+            {
+                DecisionEntry entry;
+                entry.type = (txn.decision == COMMIT ? LOG_COMMIT : LOG_ROLLBACK);
+                entry.transactionId = txn.request.id;
+                entry.lsn = txn.decisionLsn;
+                entry.payload.push_back(txn.record);
+                live.push_back(entry);
+            }
+        }
         
-        return true;
+        decisionLog->compact(live);
+        compactedLsn = decisionLog->getAppendedLsn();
     }
     
-    vector<Response> waitForResponse()
+    // Keep the decisions that were never fully acknowledged
+    void recoverDecisions()
     {
-        cout << "Waiting for response..." << endl;
-        bool hotelRes = false;
-        bool concertRes = false;
-        vector<Response> responses;
-        
-        time_t startTime;
-        time_t currentTime;
-        time(&startTime);
+        vector<DecisionEntry> entries = decisionLog->recover();
         
-        while ((!hotelRes || !concertRes) && system_status == NORMAL)
+        loggedDecisions.clear();
+        for (int i = 0;i < entries.size();i ++)
         {
-            time(&currentTime);
-            if (currentTime - startTime > 10)
+            if (entries[i].payload.empty())
             {
-                cout << "Timeout..." << endl;
-                break;
+                continue;
             }
             
-            if (!responseBuffer.empty())
+            int record = entries[i].payload[0];
+            if (entries[i].type == LOG_END)
             {
-                Response r = responseBuffer.front();
-                if (r.socket == hotelSocket)
-                {
-                    cout << "Recieved hotel " << (r.ack ? "acknowledgement " : (r.status ? "vote yes " : "vote no ")) << r.requestId << endl;
-                    hotelRes = true;
-                    responses.push_back(r);
-                }
-                else if (r.socket == concertSocket)
-                {
-                    cout << "Recieved concert " << (r.ack ? "acknowledgement " : (r.status ? "vote yes " : "vote no ")) << r.requestId << endl;
-                    concertRes = true;
-                    responses.push_back(r);
-                }
-                responseBuffer.pop();
+                loggedDecisions.erase(record);
+            }
+            else
+            {
+                loggedDecisions[record] = entries[i];
             }
         }
-        
-        return responses;
     }
     
-    bool sendAction(BookingRequest req, ActionType action)
+    // All acknowledgements are in, retire the transaction
+    void completeTransaction(map<int, Transaction>::iterator it)
     {
-        cout << "Sending " << (action == COMMIT ? "Commit " : "Rollback ") << req.id << endl;
+        Transaction & txn = it->second;
+        txn.state = ACKED;
+        cout << "2PC for " << txn.request.id << " complete." << endl;
         
-        Packet hotelAction = req.createActionPacket(hotelSocket, action);
-        Packet concertAction = req.createActionPacket(concertSocket, action);
+        uint64_t now = monotonicTime();
+        metrics.transactionTime.record((now - txn.startedAt) / 1000);
+        (txn.decision == COMMIT ? metrics.committed : metrics.aborted).fetch_add(1, memory_order_relaxed);
         
-        outputBuffer.push(hotelAction);
-        outputBuffer.push(concertAction);
+        if (latencyFile.is_open())
+        {
+            // Microseconds spent preparing, forcing the decision and in phase 2
+            latencyFile << txn.request.id << " " << (txn.decision == COMMIT ? "commit" : "abort") << " " << txn.startedAt / 1000 << " "
+                        << (txn.votedAt - txn.startedAt) / 1000 << " " << (txn.decidedAt - txn.votedAt) / 1000 << " " << (now - txn.decidedAt) / 1000 << "\n";
+        }
         
-        return true;
-    }
-    
-    void stopSubstrate()
-    {
-        if (system_status == FINISHED)
+        // Not forced, an end record lost in a failure only means resending the decision
+        if (txn.decisionLsn != 0)
         {
-            Packet finishPacket;
-            finishPacket.data = new int[1];
-            finishPacket.data[0] = 0;
-            finishPacket.length = sizeof(int);
-            finishPacket.socket = hotelSocket;
-            finishPacket.sendPacket();
-            finishPacket.socket = concertSocket;
-            finishPacket.sendPacket();
+            int record = txn.record;
+            decisionLog->append(LOG_END, txn.request.id, &record, 1);
         }
         
-        close(hotelSocket);
-        close(concertSocket);
-    }
-    
-    void failSystem()
-    {
-        outputBuffer = queue<Packet>();
-        inputBuffer = queue<Packet>();
-        responseBuffer = queue<Response>();
+        completedRecords[txn.record] = make_pair(txn.request.nextOffset, txn.request.id);
+        map<int, pair<uint64_t, int> >::iterator done;
+        while ((done = completedRecords.find(currentRecord)) != completedRecords.end())
+        {
+            resumeOffset = done->second.first;
+            lastCompletedId = done->second.second;
+            completedRecords.erase(done);
+            currentRecord ++;
+        }
         
-        cout << "Communication Substrate failed." << endl;
+        transactions.erase(it);
+        
+        if (window == 1)
+        {
+            // Unpipelined mode keeps the pause that leaves time to inject failures
+            sleep(2);
+        }
     }
-};
-
-class Coordinator
-{
-private:
-    
-    // ** Class Parameters **
-    
-    string configFile;
-    string bookingFile;
-    
-    string hotelIP;
-    string concertIP;
-    
-    queue<BookingRequest> requests;
-    
-    pthread_t processThread;
-    
-    CommunicationSubstrate * comm;
-    
-    BookingRequest currentRequest;
-    
-    ofstream outputFile;
-    ofstream logfile;
-    
-    int currentRecord = 0;
-    
-    // ** Private Functions **
     
-    // Read lines from a given file
-    vector<string> readFile(string filename)
+    // Tell a participant the outcome of a transaction it is still holding
+    void processInquiry(Response & res)
     {
-        ifstream readFile (filename);
-        string line;
-        vector<string> lines;
-        if (readFile.is_open())
+        cout << "Recieved " << comm->participantName(res.socket) << " inquiry " << res.requestId << endl;
+        metrics.inquiries.fetch_add(1, memory_order_relaxed);
+        
+        map<int, Transaction>::iterator it = transactions.find(res.requestId);
+        if (it != transactions.end())
         {
-            while (getline(readFile, line))
+            // Still undecided transactions are answered by the decision itself
+            if (it->second.state == DECIDED)
             {
-                lines.push_back(line);
+                comm->sendInquiryReply(res.socket, res.requestId, it->second.decision, true);
             }
-            readFile.close();
+            return;
         }
-        else
+        
+        for (map<int, DecisionEntry>::iterator logged = loggedDecisions.begin();logged != loggedDecisions.end();logged ++)
         {
-            cout << "Error - Could not open " << filename << endl;
-            exit(1);
+            if (logged->second.transactionId == res.requestId)
+            {
+                // Resent to everyone once its record comes up again
+                return;
+            }
         }
-        return lines;
-    }
-    
-    // Read parameters from config file
-    void readConfigFile()
-    {
-        vector<string> lines = readFile(configFile);
         
-        hotelIP = lines[0];
-        concertIP = lines[1];
-        bookingFile = lines[2];
+        // Either never decided, or rolled back or finished with every
+        // participant it held, so a participant still asking can roll back
+        comm->sendInquiryReply(res.socket, res.requestId, ROLLBACK, false);
     }
     
-    // Parse booking file line into a BookingRequest
-    BookingRequest parseBookingLine(string line)
+    // Apply a vote or acknowledgement to its transaction
+    void processResponse(Response & res)
     {
-        vector<string> data = split(line, ' ');
+        if (res.inquiry)
+        {
+            processInquiry(res);
+            return;
+        }
         
-        BookingRequest req;
-        req.id = stoi(data[0]);
-        req.tickets = stoi(data[1]);
+        string name = comm->participantName(res.socket);
+        string vote = (res.status == VOTE_YES ? "vote yes " : (res.status == VOTE_NO ? "vote no " : "vote read only "));
+        cout << "Recieved " << name << " " << (res.ack ? "acknowledgement " : vote) << res.requestId << endl;
+        
+        map<int, Transaction>::iterator it = transactions.find(res.requestId);
+        if (it == transactions.end())
+        {
+            cout << "Ignoring response for unknown id " << res.requestId << endl;
+            return;
+        }
         
-        for (int i = 2;i < data.size();i ++)
+        Transaction & txn = it->second;
+        ParticipantMetrics * participant = metricsFor(res.socket);
+        if (!res.ack && txn.state == PREPARED)
         {
-            string dateString = data[i];
+            if (participant != NULL && txn.votes.count(res.socket) == 0)
+            {
+                participant->prepareTime.record((monotonicTime() - txn.preparedAt) / 1000);
+                atomic<uint64_t> & votes = (res.status == VOTE_YES ? participant->yesVotes : (res.status == VOTE_NO ? participant->noVotes : participant->readOnlyVotes));
+                votes.fetch_add(1, memory_order_relaxed);
+            }
             
-            if (i == 2)
+            txn.votes[res.socket] = res.status;
+            if (txn.votes.size() == txn.participants.size())
             {
-                dateString = dateString.substr(1, 1);
+                decide(txn);
             }
-            else if (i == data.size() - 1)
+        }
+        else if (res.ack && txn.state == DECIDED)
+        {
+            if (txn.acks.insert(res.socket).second && participant != NULL)
             {
-                dateString = dateString.substr(0, 1);
+                participant->decisionTime.record((monotonicTime() - txn.decidedAt) / 1000);
+                participant->acks.fetch_add(1, memory_order_relaxed);
             }
             
-            int date = stoi(dateString);
-            req.dates.push_back(date);
+            if (txn.acks.size() == txn.phaseTwo.size())
+            {
+                completeTransaction(it);
+            }
         }
-        
-        return req;
     }
     
-    // Read parameters from the booking file
-    void readBookingFile()
+    // Deliver every deadline that has passed to its transaction
+    void checkTimeouts()
     {
-        vector<string> lines = readFile(bookingFile);
+        vector<TransactionTimer> expired;
+        timers.advance(TimerWheel<TransactionTimer>::now(), expired);
         
-        for (int i = 0;i < lines.size();i ++)
+        for (int i = 0;i < expired.size();i ++)
         {
-            string line = lines[i];
-            BookingRequest req = parseBookingLine(line);
-            requests.push(req);
+            map<int, Transaction>::iterator it = transactions.find(expired[i].id);
+            if (it != transactions.end() && it->second.timer == expired[i].sequence)
+            {
+                processTimeout(it->second);
+            }
         }
     }
     
-    // Start the 2PC process
-    bool twoPhaseCommit()
+    // One entry per configured participant, made once the substrate has
+    // connected to them
+    void createParticipantMetrics()
     {
-        bool status = comm->sendRequest(currentRequest);
-        
-        if (!status) {return false;}
-        
-        vector<Response> res = comm->waitForResponse();
-        
-        if (res.size() != 2)
+        for (int i = 0;i < participants.size();i ++)
         {
-            cout << "Response timeout for id " << currentRequest.id << endl;
-            return false;
+            ParticipantMetrics * participant = new ParticipantMetrics();
+            participant->name = participants[i].name;
+            metrics.participants.push_back(participant);
+            metrics.bySocket[comm->socketFor(participants[i].name)] = participant;
         }
-        
-        Response r1 = res[0];
-        Response r2 = res[1];
-        
-        if (r1.requestId != currentRequest.id || r2.requestId != currentRequest.id)
+    }
+    
+    ParticipantMetrics * metricsFor(int socket)
+    {
+        map<int, ParticipantMetrics *>::iterator it = metrics.bySocket.find(socket);
+        return (it == metrics.bySocket.end() ? NULL : it->second);
+    }
+    
+    void countMissed(vector<int> sockets)
+    {
+        for (int i = 0;i < sockets.size();i ++)
         {
-            cout << "Error - Expected id " << currentRequest.id << ", recieved " << r1.requestId << " and " << r2.requestId << endl;
-            return false;
+            ParticipantMetrics * participant = metricsFor(sockets[i]);
+            if (participant != NULL)
+            {
+                participant->missed.fetch_add(1, memory_order_relaxed);
+            }
+        }
+    }
+    
+    // Resend whichever phase went unanswered past its deadline
+    void processTimeout(Transaction & txn)
+    {
+        if (txn.state == VOTED)
+        {
+            // Waiting on the decision log, which arms the next deadline
+            return;
         }
         
-        if (r1.status == VOTE_YES && r2.status == VOTE_YES)
+        cout << "Response timeout for id " << txn.request.id << endl;
+        if (txn.state == DECIDED)
         {
-            status = comm->sendAction(currentRequest, COMMIT);
-            outputFile << currentRequest.id << " Success" << endl;
+            armTimer(txn, decisionTimeout);
+            
+            set<int> unacknowledged;
+            set_difference(txn.phaseTwo.begin(), txn.phaseTwo.end(), txn.acks.begin(), txn.acks.end(), inserter(unacknowledged, unacknowledged.begin()));
+            countMissed(vector<int>(unacknowledged.begin(), unacknowledged.end()));
+            metrics.decisionTimeouts.fetch_add(1, memory_order_relaxed);
+            comm->sendAction(txn.request, unacknowledged, txn.decision, true);
         }
         else
         {
-            status = comm->sendAction(currentRequest, ROLLBACK);
-            outputFile << currentRequest.id << " Fail" << endl;
+            vector<int> silent;
+            for (int i = 0;i < txn.participants.size();i ++)
+            {
+                if (txn.votes.count(txn.participants[i]) == 0)
+                {
+                    silent.push_back(txn.participants[i]);
+                }
+            }
+            countMissed(silent);
+            metrics.prepareTimeouts.fetch_add(1, memory_order_relaxed);
+            
+            // A one phase request is decided by its participant, so only
+            // that participant can settle it
+            if (!txn.onePhase && prepareAttempts > 0 && ++ txn.prepareTimeouts >= prepareAttempts)
+            {
+                rollBackSilent(txn, silent);
+                return;
+            }
+            beginPrepare(txn);
         }
-        
-        res = comm->waitForResponse();
-        
-        if (res.size() != 2)
+    }
+    
+    // Stop waiting on participants that never answered the prepare. Their
+    // silence counts as a no vote, and they are sent the rollback with the
+    // yes voters in case only their vote was lost.
+    void rollBackSilent(Transaction & txn, vector<int> & silent)
+    {
+        cout << "Rolling back id " << txn.request.id << " after " << txn.prepareTimeouts << " prepare timeouts" << endl;
+        for (int i = 0;i < silent.size();i ++)
         {
-            cout << "Response timeout for id " << currentRequest.id << endl;
-            return false;
+            txn.votes[silent[i]] = VOTE_NO;
+            txn.phaseTwo.insert(silent[i]);
         }
-        
-        cout << "2PC for " << currentRequest.id << " complete." << endl;
-        
-        return true;
+        decide(txn);
     }
     
     void finishSystem()
     {
         cout << "All requests processed" << endl;
+        reader->stop();
         outputFile.close();
+        latencyFile.close();
         logfile.close();
+        decisionLog->close(true);
         system_status = FINISHED;
         comm->stopSubstrate();
         exit(0);
@@ -582,28 +3971,76 @@ private:
         return ((Coordinator *)context)->processBookingRequests(NULL);
     }
     
+    // Wake thread B from the reader or decision log threads
+    static void wakeCaller(void * context)
+    {
+        ((Coordinator *)context)->comm->wake();
+    }
+    
+    // Milliseconds thread B may sleep before a deadline comes due or a
+    // partial batch has lingered long enough
+    int idleTimeout()
+    {
+        uint64_t now = TimerWheel<TransactionTimer>::now();
+        uint64_t next = timers.nextExpiry();
+        uint64_t wakeAt = (next == 0 ? now + 1000 : min(next, now + 1000));
+        
+        if (!prepareBatch.empty())
+        {
+            wakeAt = min(wakeAt, (batchStart + (uint64_t) lingerTime * 1000000 + 999999) / 1000000);
+        }
+        
+        return (wakeAt > now ? (int)(wakeAt - now) : 0);
+    }
+    
     // Threaded function to process requests
     void * processBookingRequests(void *)
     {
         if (system_status == RECOVERY)
         {
-            for (int i = 0;i < currentRecord;i ++)
-            {
-                requests.pop();
-            }
+            // The reader skipped the records before currentRecord
+            nextRecord = currentRecord;
+            transactions.clear();
+            timers.clear();
+            prepareBatch.clear();
+            awaitingDecisions.clear();
+            compactDecisionLog();
             
             system_status = NORMAL;
             cout << "System fully recovered." << endl;
         }
         
-        while (!requests.empty() && system_status == NORMAL)
+        while ((requestsLeft() || !transactions.empty()) && system_status == NORMAL)
         {
-            currentRequest = requests.front();
-            if (twoPhaseCommit())
+            uint64_t wakeCount = comm->wakeCount();
+            
+            fillWindow();
+            checkPrepareBatch();
+            
+            Response res;
+            bool received = comm->pollResponse(res);
+            if (received)
+            {
+                processResponse(res);
+            }
+            
+            releaseDecisions();
+            checkTimeouts();
+            
+            if (decisionLogCompact > 0 && decisionLog->getAppendedLsn() - compactedLsn >= (uint64_t) decisionLogCompact)
+            {
+                compactDecisionLog();
+            }
+            
+            metrics.inFlight.store(transactions.size(), memory_order_relaxed);
+            metrics.awaitingDecisions.store(awaitingDecisions.size(), memory_order_relaxed);
+            metrics.parsedBookings.store(reader->queued(), memory_order_relaxed);
+            
+            if (!received)
             {
-                requests.pop();
-                currentRecord ++;
-                sleep(2);
+                // Responses, parsed bookings and durable decisions all end
+                // the wait, including any that came since wakeCount was read
+                comm->waitForResponse(idleTimeout(), wakeCount);
             }
         }
         
@@ -614,29 +4051,151 @@ private:
         pthread_exit(NULL);
     }
     
+    // Function to start the stats thread
+    static void * statsThreadCaller(void * context)
+    {
+        return ((Coordinator *)context)->waitForStatsSignal(NULL);
+    }
+    
+    // Threaded function that prints the stats each time SIGUSR1 arrives.
+    // Every other thread blocks the signal, so it is only taken here.
+    void * waitForStatsSignal(void *)
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        
+        int signal;
+        while (sigwait(&signals, &signal) == 0)
+        {
+            printStats();
+        }
+        
+        pthread_exit(NULL);
+    }
+    
+    // Called by the metrics server for each scrape
+    static string metricsCaller(void * context)
+    {
+        return ((Coordinator *)context)->renderMetrics();
+    }
+    
+    // The metrics in Prometheus text format, times in seconds
+    string renderMetrics()
+    {
+        ostringstream text;
+        text << "# TYPE coordinator_transactions_total counter\n";
+        text << "coordinator_transactions_total{outcome=\"commit\"} " << metrics.committed << "\n";
+        text << "coordinator_transactions_total{outcome=\"abort\"} " << metrics.aborted << "\n";
+        text << "# TYPE coordinator_transactions_in_flight gauge\n";
+        text << "coordinator_transactions_in_flight " << metrics.inFlight << "\n";
+        text << "# TYPE coordinator_transaction_seconds histogram\n";
+        text << metrics.transactionTime.prometheus("coordinator_transaction_seconds", "");
+        text << "# TYPE coordinator_batch_wait_seconds histogram\n";
+        text << metrics.batchWait.prometheus("coordinator_batch_wait_seconds", "");
+        
+        text << "# TYPE coordinator_votes_total counter\n";
+        for (int i = 0;i < metrics.participants.size();i ++)
+        {
+            ParticipantMetrics * participant = metrics.participants[i];
+            string label = "participant=\"" + participant->name + "\"";
+            text << "coordinator_votes_total{" << label << ",vote=\"yes\"} " << participant->yesVotes << "\n";
+            text << "coordinator_votes_total{" << label << ",vote=\"no\"} " << participant->noVotes << "\n";
+            text << "coordinator_votes_total{" << label << ",vote=\"read_only\"} " << participant->readOnlyVotes << "\n";
+        }
+        text << "# TYPE coordinator_acks_total counter\n";
+        for (int i = 0;i < metrics.participants.size();i ++)
+        {
+            text << "coordinator_acks_total{participant=\"" << metrics.participants[i]->name << "\"} " << metrics.participants[i]->acks << "\n";
+        }
+        text << "# TYPE coordinator_missed_replies_total counter\n";
+        for (int i = 0;i < metrics.participants.size();i ++)
+        {
+            text << "coordinator_missed_replies_total{participant=\"" << metrics.participants[i]->name << "\"} " << metrics.participants[i]->missed << "\n";
+        }
+        text << "# TYPE coordinator_prepare_round_trip_seconds histogram\n";
+        for (int i = 0;i < metrics.participants.size();i ++)
+        {
+            text << metrics.participants[i]->prepareTime.prometheus("coordinator_prepare_round_trip_seconds", "participant=\"" + metrics.participants[i]->name + "\"");
+        }
+        text << "# TYPE coordinator_decision_round_trip_seconds histogram\n";
+        for (int i = 0;i < metrics.participants.size();i ++)
+        {
+            text << metrics.participants[i]->decisionTime.prometheus("coordinator_decision_round_trip_seconds", "participant=\"" + metrics.participants[i]->name + "\"");
+        }
+        
+        text << "# TYPE coordinator_decision_log_flush_seconds histogram\n";
+        text << metrics.decisionLog.flushTime.prometheus("coordinator_decision_log_flush_seconds", "");
+        text << "# TYPE coordinator_timeouts_total counter\n";
+        text << "coordinator_timeouts_total{phase=\"prepare\"} " << metrics.prepareTimeouts << "\n";
+        text << "coordinator_timeouts_total{phase=\"decision\"} " << metrics.decisionTimeouts << "\n";
+        text << "# TYPE coordinator_inquiries_total counter\n";
+        text << "coordinator_inquiries_total " << metrics.inquiries << "\n";
+        
+        text << "# TYPE coordinator_queue_depth gauge\n";
+        text << "coordinator_queue_depth{queue=\"input\"} " << comm->inputQueued() << "\n";
+        text << "coordinator_queue_depth{queue=\"output\"} " << comm->outputQueued() << "\n";
+        text << "coordinator_queue_depth{queue=\"response\"} " << comm->responsesQueued() << "\n";
+        text << "coordinator_queue_depth{queue=\"parsed\"} " << metrics.parsedBookings << "\n";
+        text << "coordinator_queue_depth{queue=\"awaiting_log\"} " << metrics.awaitingDecisions << "\n";
+        text << "# TYPE coordinator_sent_bytes_total counter\n";
+        text << "coordinator_sent_bytes_total " << comm->getBytesSent() << "\n";
+        text << "# TYPE coordinator_received_bytes_total counter\n";
+        text << "coordinator_received_bytes_total " << comm->getBytesRecieved() << "\n";
+        return text.str();
+    }
+    
     void initCoordinator(string configFilename)
     {
         configFile = configFilename;
         bookingFile = "";
         
-        hotelIP = "127.0.0.1";
-        concertIP = "127.0.0.1";
-        
         cout << "Parsing config and booking files..." << endl;
         readConfigFile();
-        readBookingFile();
-        cout << "Coordinator initialization complete." << endl;
+        if (participants.empty())
+        {
+            cout << "Error - No participants in " << configFile << endl;
+            exit(1);
+        }
         
         logfile.open ("log.txt", ios::trunc);
         if (system_status == RECOVERY)
         {
             outputFile.open ("output.txt", ios::app);
+            if (!latencyLogName.empty())
+            {
+                latencyFile.open (latencyLogName, ios::app);
+            }
+            decisionLog = new DecisionLog(decisionLogName, false, groupCommitWindow, &Coordinator::wakeCaller, this);
+            recoverDecisions();
+            cout << "Recovered " << loggedDecisions.size() << " logged decisions" << endl;
         }
         else
         {
             outputFile.open ("output.txt", ios::trunc);
-            comm = new CommunicationSubstrate(hotelIP, concertIP);
+            if (!latencyLogName.empty())
+            {
+                latencyFile.open (latencyLogName, ios::trunc);
+            }
+            openFreshDecisionLog();
+            comm = new CommunicationSubstrate(participants);
+            createParticipantMetrics();
         }
+        decisionLog->setMetrics(&metrics.decisionLog);
+        
+        // Bookings are read while the first ones are processed. The reader
+        // wakes the process thread, so it starts once the substrate is up.
+        reader = new BookingReader(bookingFile, &Coordinator::wakeCaller, this);
+        if (system_status == RECOVERY)
+        {
+            reader->start(currentRecord, resumeOffset, lastCompletedId);
+        }
+        else
+        {
+            reader->start(0, 0, 0);
+        }
+        haveNext = false;
+        cout << "Coordinator initialization complete." << endl;
     }
     
 public:
@@ -662,20 +4221,91 @@ public:
         cout << "Coordinator started." << endl;
     }
     
+    void startStatsThread()
+    {
+        if (int s = pthread_create(&statsThread, NULL, &Coordinator::statsThreadCaller, this))
+        {
+            cout << "Error creating stats thread. Code - " << s << endl;
+            exit(1);
+        }
+        pthread_detach(statsThread);
+    }
+    
+    void startMetricsServer()
+    {
+        if (metricsPort > 0 || !metricsSocket.empty())
+        {
+            metricsServer = new MetricsServer(metricsPort, metricsSocket, &Coordinator::metricsCaller, this);
+        }
+    }
+    
+    // Counters, queue depths and latency percentiles in microseconds. Only
+    // reads the metrics, so the process thread keeps running meanwhile.
+    void printStats()
+    {
+        ostringstream stats;
+        stats << "Stats:" << endl;
+        stats << "  transactions committed " << metrics.committed << " aborted " << metrics.aborted << " in flight " << metrics.inFlight << endl;
+        stats << "  transaction time " << metrics.transactionTime.summary() << endl;
+        stats << "  batch wait " << metrics.batchWait.summary() << endl;
+        
+        for (int i = 0;i < metrics.participants.size();i ++)
+        {
+            ParticipantMetrics * participant = metrics.participants[i];
+            stats << "  " << participant->name << " votes yes " << participant->yesVotes << " no " << participant->noVotes << " read only " << participant->readOnlyVotes
+                  << " acks " << participant->acks << " missed " << participant->missed << endl;
+            stats << "  " << participant->name << " prepare round trip " << participant->prepareTime.summary() << endl;
+            stats << "  " << participant->name << " decision round trip " << participant->decisionTime.summary() << endl;
+        }
+        
+        stats << "  decision log flush " << metrics.decisionLog.flushTime.summary() << endl;
+        stats << "  decision log records per flush " << metrics.decisionLog.flushRecords.summary() << endl;
+        stats << "  timeouts prepare " << metrics.prepareTimeouts << " decision " << metrics.decisionTimeouts << " inquiries " << metrics.inquiries << endl;
+        stats << "  queues input " << comm->inputQueued() << " output " << comm->outputQueued() << " responses " << comm->responsesQueued()
+              << " parsed " << metrics.parsedBookings << " awaiting log " << metrics.awaitingDecisions << endl;
+        
+        cout << stats.str() << flush;
+    }
+    
     void failSystem()
     {
         system_status = FAILED;
-        requests = queue<BookingRequest>();
+        comm->wake();
+        pthread_join(processThread, NULL);
+        
+        reader->stop();
+        delete reader;
+        reader = NULL;
         
         comm->failSystem();
         
+        // Decisions not yet on disk are lost, and were never sent. Those
+        // already on disk are resent on recovery, so their outcome stands.
+        decisionLog->close(false);
+        uint64_t durableLsn = decisionLog->getDurableLsn();
+        for (int i = 0;i < awaitingDecisions.size();i ++)
+        {
+            Transaction & txn = transactions[awaitingDecisions[i]];
+            if (txn.decisionLsn <= durableLsn)
+            {
+                outputFile << txn.request.id << (txn.decision == COMMIT ? " Success" : " Fail") << endl;
+            }
+        }
+        delete decisionLog;
+        decisionLog = NULL;
+        
         logfile << configFile << endl;
-        logfile << currentRecord << endl;
+        logfile << currentRecord << " " << resumeOffset << " " << lastCompletedId << endl;
+        for (map<int, pair<uint64_t, int> >::iterator it = completedRecords.begin();it != completedRecords.end();it ++)
+        {
+            logfile << it->first << " " << it->second.first << " " << it->second.second << endl;
+        }
         
         outputFile << "System Failed." << endl;
         
         logfile.close();
         outputFile.close();
+        latencyFile.close();
         
         cout << "System failed and sleeping." << endl;
     }
@@ -686,8 +4316,17 @@ public:
         
         vector<string> lines = readFile("log.txt");
         configFile = lines[0];
-        currentRecord = stoi(lines[1]);
-        cout << "Starting on record " << currentRecord << endl;
+        vector<string> progress = split(lines[1], ' ');
+        currentRecord = stoi(progress[0]);
+        resumeOffset = stoull(progress[1]);
+        lastCompletedId = stoi(progress[2]);
+        completedRecords.clear();
+        for (int i = 2;i < lines.size();i ++)
+        {
+            vector<string> completed = split(lines[i], ' ');
+            completedRecords[stoi(completed[0])] = make_pair(stoull(completed[1]), stoi(completed[2]));
+        }
+        cout << "Starting on record " << currentRecord << " at byte " << resumeOffset << endl;
         
         initCoordinator(configFile);
         
@@ -712,13 +4351,47 @@ public:
                 cout << "Starting recovery..." << endl;
                 recoverSystem();
             }
+            else if (command == "stats")
+            {
+                printStats();
+            }
         }
     }
 };
 
+// Convert a text booking file to the binary format
+int convertBookingFile(string textFile, string binaryFile)
+{
+    BookingReader reader(textFile, NULL, NULL);
+    BookingWriter writer(binaryFile);
+    BookingRequest req;
+    
+    reader.start(0, 0, 0);
+    while (reader.hasMore())
+    {
+        if (reader.next(req))
+        {
+            writer.write(req);
+        }
+        else
+        {
+            reader.waitForBookings(10);
+        }
+    }
+    reader.stop();
+    writer.close();
+    
+    return 0;
+}
+
 // Main function
 int main(int argc, const char * argv[])
 {
+    if (argc == 4 && string(argv[1]) == "--convert")
+    {
+        return convertBookingFile(argv[2], argv[3]);
+    }
+    
     if (argc != 2)
     {
         cout << "Error - wrong command line arguments" << endl;
@@ -729,7 +4402,15 @@ int main(int argc, const char * argv[])
     
     signal(SIGPIPE, SIG_IGN);
     
+    // Blocked before any thread starts, so only the stats thread takes it
+    sigset_t statsSignal;
+    sigemptyset(&statsSignal);
+    sigaddset(&statsSignal, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &statsSignal, NULL);
+    
     Coordinator * coor = new Coordinator(configFile);
+    coor->startStatsThread();
+    coor->startMetricsServer();
     coor->startServer();
     coor->startFailureSimulation();
     
@@ -13,13 +13,33 @@
 #include <sstream>
 #include <pthread.h>
 #include <cstring>
+#include <cstdint>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <queue>
+#include <map>
+#include <deque>
+#include <set>
+#include <atomic>
+#include <utility>
+#include <new>
+#include <algorithm>
+#include <iterator>
 #include <time.h>
 #include <signal.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
 using namespace std;
 
 // ** Global Types and Properties
@@ -33,7 +53,8 @@ enum ActionType
 enum VoteStatus
 {
     VOTE_NO = 0,
-    VOTE_YES = 1
+    VOTE_YES = 1,
+    VOTE_READ_ONLY = 2
 };
 
 enum SystemStatus
@@ -44,512 +65,4214 @@ enum SystemStatus
     FINISHED = 3
 };
 
+enum MessageType
+{
+    MSG_PREPARE = 1,
+    MSG_VOTE = 2,
+    MSG_DECISION = 3,
+    MSG_ACK = 4,
+    MSG_FINISH = 5,
+    MSG_PREPARE_BATCH = 6,
+    MSG_VOTE_BATCH = 7,
+    MSG_INQUIRY = 8,
+    MSG_ONE_PHASE = 9
+};
+
+const uint16_t PROTOCOL_VERSION = 1;
+const uint32_t MAX_FRAME_PAYLOAD = 1 << 20;
+const int RECIEVE_BUFFER_SIZE = 1 << 16;
+const int CACHE_LINE_SIZE = 64;
+
+// Slots in each substrate queue
+const int RING_CAPACITY = 4096;
+
 SystemStatus system_status;
 
+// Nanoseconds on the monotonic clock
+uint64_t monotonicTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Every message on the wire starts with this header, followed by
+// length bytes of payload. Fields are in host byte order.
+struct FrameHeader
+{
+    uint16_t type;
+    uint16_t version;
+    uint32_t length;
+    uint64_t transactionId;
+    uint64_t timestamp;
+};
+
+// Pooled packet buffers come in power of two sizes from 64 bytes to 64KB.
+// Bigger frames are allocated on their own.
+const int POOL_CLASSES = 11;
+const int POOL_MIN_SHIFT = 6;
+
+// Buffers a thread keeps of each size before handing half of them back
+const int POOL_CACHE_LIMIT = 64;
+
+// Sits in front of every packet buffer
+struct BufferHeader
+{
+    atomic<int> references;
+    int sizeClass;
+    BufferHeader * next;
+};
+
+// Recycles packet buffers instead of going to the heap for every message.
+// Each thread takes from and returns to its own cache, and only touches the
+// shared depot, a batch at a time, when its cache runs empty or over.
+class BufferPool
+{
+private:
+    
+    // ** Class Parameters **
+    
+    struct ThreadCache
+    {
+        BufferHeader * buffers[POOL_CLASSES];
+        int counts[POOL_CLASSES];
+        
+        ThreadCache();
+        ~ThreadCache();
+    };
+    
+    pthread_mutex_t depotLock;
+    BufferHeader * depot[POOL_CLASSES];
+    
+    // ** Private Functions **
+    
+    static ThreadCache & threadCache()
+    {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+    
+    static int sizeClassFor(size_t length)
+    {
+        int sizeClass = 0;
+        while (sizeClass < POOL_CLASSES && ((size_t)1 << (sizeClass + POOL_MIN_SHIFT)) < length)
+        {
+            sizeClass ++;
+        }
+        return (sizeClass < POOL_CLASSES ? sizeClass : -1);
+    }
+    
+    static BufferHeader * createBuffer(int sizeClass, size_t length)
+    {
+        size_t capacity = (sizeClass < 0 ? length : (size_t)1 << (sizeClass + POOL_MIN_SHIFT));
+        char * raw = new char[sizeof(BufferHeader) + capacity];
+        
+        BufferHeader * buffer = new (raw) BufferHeader();
+        buffer->sizeClass = sizeClass;
+        buffer->next = NULL;
+        return buffer;
+    }
+    
+    static void destroyBuffer(BufferHeader * buffer)
+    {
+        buffer->~BufferHeader();
+        delete [] (char *)buffer;
+    }
+    
+    // Move up to count buffers of one size between a cache and the depot
+    void refill(ThreadCache & cache, int sizeClass, int count)
+    {
+        pthread_mutex_lock(&depotLock);
+        while (count -- > 0 && depot[sizeClass] != NULL)
+        {
+            BufferHeader * buffer = depot[sizeClass];
+            depot[sizeClass] = buffer->next;
+            buffer->next = cache.buffers[sizeClass];
+            cache.buffers[sizeClass] = buffer;
+            cache.counts[sizeClass] ++;
+        }
+        pthread_mutex_unlock(&depotLock);
+    }
+    
+    void spill(ThreadCache & cache, int sizeClass, int count)
+    {
+        pthread_mutex_lock(&depotLock);
+        while (count -- > 0 && cache.buffers[sizeClass] != NULL)
+        {
+            BufferHeader * buffer = cache.buffers[sizeClass];
+            cache.buffers[sizeClass] = buffer->next;
+            cache.counts[sizeClass] --;
+            buffer->next = depot[sizeClass];
+            depot[sizeClass] = buffer;
+        }
+        pthread_mutex_unlock(&depotLock);
+    }
+    
+    // Hand a finished thread's buffers to the depot for the others
+    void returnCache(ThreadCache & cache)
+    {
+        for (int i = 0;i < POOL_CLASSES;i ++)
+        {
+            spill(cache, i, cache.counts[i]);
+        }
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    BufferPool()
+    {
+        pthread_mutex_init(&depotLock, NULL);
+        for (int i = 0;i < POOL_CLASSES;i ++)
+        {
+            depot[i] = NULL;
+        }
+    }
+    
+    // A buffer of at least length bytes holding one reference
+    char * allocate(size_t length)
+    {
+        int sizeClass = sizeClassFor(length);
+        BufferHeader * buffer = NULL;
+        
+        if (sizeClass >= 0)
+        {
+            ThreadCache & cache = threadCache();
+            if (cache.buffers[sizeClass] == NULL)
+            {
+                refill(cache, sizeClass, POOL_CACHE_LIMIT / 2);
+            }
+            
+            buffer = cache.buffers[sizeClass];
+            if (buffer != NULL)
+            {
+                cache.buffers[sizeClass] = buffer->next;
+                cache.counts[sizeClass] --;
+            }
+        }
+        
+        if (buffer == NULL)
+        {
+            buffer = createBuffer(sizeClass, length);
+        }
+        
+        buffer->references.store(1, memory_order_relaxed);
+        return (char *)(buffer + 1);
+    }
+    
+    void retain(char * data)
+    {
+        ((BufferHeader *)data - 1)->references.fetch_add(1, memory_order_relaxed);
+    }
+    
+    // Drop a reference, recycling the buffer with the last one
+    void release(char * data)
+    {
+        BufferHeader * buffer = (BufferHeader *)data - 1;
+        if (buffer->references.fetch_sub(1, memory_order_acq_rel) != 1)
+        {
+            return;
+        }
+        
+        if (buffer->sizeClass < 0)
+        {
+            destroyBuffer(buffer);
+            return;
+        }
+        
+        ThreadCache & cache = threadCache();
+        buffer->next = cache.buffers[buffer->sizeClass];
+        cache.buffers[buffer->sizeClass] = buffer;
+        
+        if (++ cache.counts[buffer->sizeClass] > POOL_CACHE_LIMIT)
+        {
+            spill(cache, buffer->sizeClass, POOL_CACHE_LIMIT / 2);
+        }
+    }
+};
+
+BufferPool packetPool;
+
+BufferPool::ThreadCache::ThreadCache()
+{
+    for (int i = 0;i < POOL_CLASSES;i ++)
+    {
+        buffers[i] = NULL;
+        counts[i] = 0;
+    }
+}
+
+BufferPool::ThreadCache::~ThreadCache()
+{
+    packetPool.returnCache(*this);
+}
+
 struct Packet
 {
     int socket;
-    int * data;
+    char * data;
     int length;
-    int timestamp;
     
-    void sendPacket()
+    FrameHeader * header()
+    {
+        return (FrameHeader *)data;
+    }
+    
+    int * payload()
+    {
+        return (int *)(data + sizeof(FrameHeader));
+    }
+    
+    // Give the buffer back to the pool once every holder has released it
+    void release()
     {
-        send(socket, data, length, 0);
+        packetPool.release(data);
+        data = NULL;
     }
     
-    static Packet createFromRawData(int * data, int socket, int length)
+    // Allocate a frame with room for payloadInts ints after the header
+    static Packet createFrame(int socket, MessageType type, uint64_t transactionId, int payloadInts)
     {
         Packet p;
         
         p.socket = socket;
-        p.data = data;
-        p.length = length;
-        p.timestamp = data[0];
+        p.length = (int)(sizeof(FrameHeader) + payloadInts * sizeof(int));
+        p.data = packetPool.allocate(p.length);
+        
+        FrameHeader * header = p.header();
+        header->type = type;
+        header->version = PROTOCOL_VERSION;
+        header->length = payloadInts * sizeof(int);
+        header->transactionId = transactionId;
+        header->timestamp = monotonicTime();
         
         return p;
     }
     
-    static Packet createVotePacket(VoteStatus vote, int socket, int requestId)
+    static Packet createFromRawData(const char * data, int socket, int length)
     {
         Packet p;
         
         p.socket = socket;
-        p.data = new int[3];
-        p.length = 3 * sizeof(int);
-        
-        time_t currentTime;
-        time(&currentTime);
-        p.data[0] = (int)currentTime;
-        p.data[1] = requestId;
-        p.data[2] = vote;
+        p.data = packetPool.allocate(length);
+        memcpy(p.data, data, length);
+        p.length = length;
         
         return p;
     }
     
-    static Packet createAckPacket(int socket, int requestId)
+    static Packet createVotePacket(VoteStatus vote, int socket, int requestId)
     {
-        Packet p;
+        Packet p = Packet::createFrame(socket, MSG_VOTE, requestId, 1);
         
-        p.socket = socket;
-        p.length = 2 * sizeof(int);
-        p.data = new int[2];
+        p.payload()[0] = vote;
         
-        time_t currentTime;
-        time(&currentTime);
-        p.data[0] = (int)currentTime;
+        return p;
+    }
+    
+    static Packet createAckPacket(int socket, int requestId)
+    {
+        return Packet::createFrame(socket, MSG_ACK, requestId, 0);
+    }
+    
+    // Ask the coordinator for the outcome of a prepared request
+    static Packet createInquiryPacket(int socket, int requestId)
+    {
+        return Packet::createFrame(socket, MSG_INQUIRY, requestId, 0);
+    }
+    
+    // One frame of [count, (id, vote)...] answering a prepare batch
+    static Packet createVoteBatchPacket(int socket, vector<int> & requestIds, vector<VoteStatus> & votes)
+    {
+        int count = (int) requestIds.size();
+        Packet p = Packet::createFrame(socket, MSG_VOTE_BATCH, requestIds[0], 1 + count * 2);
         
-        p.data[1] = requestId;
+        int * payload = p.payload();
+        payload[0] = count;
+        for (int i = 0;i < count;i ++)
+        {
+            payload[1 + i * 2] = requestIds[i];
+            payload[2 + i * 2] = votes[i];
+        }
         
         return p;
     }
 };
 
-struct Response
+struct Connection
 {
-    int requestId = 0;
-    bool isRequest;
     int socket;
-    int tickets;
-    vector<int> dates;
-    ActionType action;
+    string name;
+    string readBuffer;
+    string writeBuffer;
+    bool writeBlocked;
+};
+
+// Keeps a pooled frame alive for as long as any copy of it is around
+struct FrameRef
+{
+    Packet packet;
     
-    static Response createFromPacket(Packet p)
+    FrameRef()
     {
-        Response res;
-        
-        res.socket = p.socket;
-        res.requestId = p.data[1];
-        if (p.length > 12)
+        packet.data = NULL;
+    }
+    
+    FrameRef(Packet & p)
+    {
+        packet = p;
+        packetPool.retain(packet.data);
+    }
+    
+    FrameRef(const FrameRef & other)
+    {
+        packet = other.packet;
+        if (packet.data != NULL)
         {
-            res.isRequest = true;
-            res.tickets = p.data[2];
-            int dateCount = p.data[3];
-            
-            for (int i = 0;i < dateCount;i ++)
-            {
-                int date = p.data[4 + i];
-                res.dates.push_back(date);
-            }
+            packetPool.retain(packet.data);
         }
-        else
+    }
+    
+    FrameRef & operator=(const FrameRef & other)
+    {
+        if (other.packet.data != NULL)
         {
-            res.isRequest = false;
-            res.action = ActionType(p.data[2]);
+            packetPool.retain(other.packet.data);
+        }
+        reset();
+        packet = other.packet;
+        return *this;
+    }
+    
+    ~FrameRef()
+    {
+        reset();
+    }
+    
+    void reset()
+    {
+        if (packet.data != NULL)
+        {
+            packet.release();
         }
-        
-        return res;
     }
 };
 
-// ** Global Functions **
+// Bookings name a handful of dates, so up to this many are kept inline
+const int INLINE_DATES = 12;
 
-// Split string by a delimeter into a vector of tokens
-vector<string> split(string fullString, char delimiter)
+// The dates of one request. Short lists live inside the object, so
+// decoding and copying a request doesn't touch the heap, and only a list
+// longer than INLINE_DATES moves out to a vector.
+struct DateList
 {
-    vector<string> splits;
-    stringstream stream(fullString);
-    string token;
+    typedef int value_type;
     
-    while(getline(stream, token, delimiter))
+    int count = 0;
+    int inlineDates[INLINE_DATES];
+    vector<int> spilled;
+    
+    int * begin()
     {
-        splits.push_back(token);
+        return (count > INLINE_DATES ? spilled.data() : inlineDates);
     }
     
-    return splits;
-}
-
-class CommunicationSubstrate
-{
-private:
+    int * end()
+    {
+        return begin() + count;
+    }
     
-    // ** Class Parameters **
+    int size()
+    {
+        return count;
+    }
+    
+    bool empty()
+    {
+        return count == 0;
+    }
     
-    pthread_t bufferThread;
-    pthread_t recieveThread;
+    int & operator[](int i)
+    {
+        return begin()[i];
+    }
     
-    queue<Packet> inputBuffer;
-    queue<Packet> outputBuffer;
+    void clear()
+    {
+        count = 0;
+        spilled.clear();
+    }
     
-    sockaddr_in serverSocketInfo;
-    sockaddr_in coordinatorInfo;
+    void push_back(int date)
+    {
+        if (count < INLINE_DATES)
+        {
+            inlineDates[count] = date;
+        }
+        else
+        {
+            if (count == INLINE_DATES)
+            {
+                spilled.assign(inlineDates, inlineDates + INLINE_DATES);
+            }
+            spilled.push_back(date);
+        }
+        count ++;
+    }
     
-    int coordinatorSocket;
-    int messageSocket;
+    template <typename Iterator>
+    void assign(Iterator first, Iterator last)
+    {
+        clear();
+        for (;first != last;first ++)
+        {
+            push_back(*first);
+        }
+    }
+};
+
+// Names the timer waiting on one prepared request's decision. Every timer
+// gets a new sequence number, so one left over from an earlier prepare of
+// the same request is ignored.
+struct DecisionTimer
+{
+    int requestId;
+    uint64_t sequence;
+};
+
+// How a one phase request was decided, kept to answer a resend. The
+// record is -1 when it was finished by replay without one.
+struct OnePhaseOutcome
+{
+    int record;
+    VoteStatus vote;
+};
+
+struct Response
+{
+    int requestId = 0;
+    bool isRequest;
+    int socket;
+    int tickets;
+    DateList dates;
+    ActionType action;
+    bool ackRequired = true;
+    bool onePhase = false;
+    bool finish = false;
     
-    string participantAddress;
+    // A one phase request's record in the coordinator's booking file, and
+    // the record every booking before is complete. -1 when not sent.
+    int record = -1;
+    int lowWater = -1;
     
-    queue<Response> responseBuffer;
+    // Sequence number of the timer waiting on a prepared request's decision
+    uint64_t decisionTimer = 0;
     
-    // ** Private Functions **
+    // A prepare batch keeps its frame and its requests are read straight
+    // out of it, in the order they were sent
+    bool isBatch = false;
+    FrameRef frame;
     
-    void populateIPAddress(sockaddr_in * address, string addressInfo)
+    int batchSize()
     {
-        address->sin_family = AF_INET;
-        vector<string> addressParts = split(addressInfo, ':');
-        address->sin_port = htons(stoi(addressParts[1]));
-        inet_pton(AF_INET, addressParts[0].c_str(), &address->sin_addr);
+        return (frame.packet.data != NULL ? frame.packet.payload()[0] : 0);
     }
     
-    void connectToCoordinator(bool fresh)
+    // Decode the batched request at pos, which starts at 1, and move pos
+    // past it. False once the frame runs out.
+    bool nextInBatch(int & pos, Response & req)
     {
-        if (fresh)
+        if (frame.packet.data == NULL)
         {
-            populateIPAddress(&serverSocketInfo, participantAddress);
-            if (::bind(coordinatorSocket, (sockaddr *)&serverSocketInfo, sizeof(serverSocketInfo)) == -1)
-            {
-                cout << "Bind error " << errno << endl;
-                exit(1);
-            }
-            
-            if (listen(coordinatorSocket, 0) == -1)
-            {
-                cout << "Listen error" << errno << endl;
-                exit(1);
-            }
-            
-            cout << "Bound on address " << participantAddress << endl;
+            return false;
+        }
+        
+        int l = frame.packet.header()->length / sizeof(int);
+        if (pos + 3 > l)
+        {
+            return false;
+        }
+        
+        int * payload = frame.packet.payload();
+        req.socket = socket;
+        req.isRequest = true;
+        req.requestId = payload[pos ++];
+        req.tickets = payload[pos ++];
+        int dateCount = payload[pos ++];
+        dateCount = max(min(dateCount, l - pos), 0);
+        
+        req.dates.assign(payload + pos, payload + pos + dateCount);
+        pos += dateCount;
+        return true;
+    }
+    
+    static Response createFromPacket(Packet & p)
+    {
+        Response res;
+        
+        res.socket = p.socket;
+        res.requestId = (int) p.header()->transactionId;
+        int * payload = p.payload();
+        if (p.header()->type == MSG_FINISH)
+        {
+            res.isRequest = false;
+            res.finish = true;
+        }
+        else if (p.header()->type == MSG_PREPARE_BATCH)
+        {
+            res.isRequest = true;
+            res.isBatch = true;
+            if (p.header()->length >= sizeof(int))
+            {
+                res.frame = FrameRef(p);
+            }
+        }
+        else if (p.header()->type == MSG_PREPARE || p.header()->type == MSG_ONE_PHASE)
+        {
+            res.isRequest = true;
+            res.onePhase = (p.header()->type == MSG_ONE_PHASE);
+            res.tickets = payload[0];
+            int l = (int)(p.header()->length / sizeof(int));
+            int dateCount = max(min(payload[1], l - 2), 0);
+            res.dates.assign(payload + 2, payload + 2 + dateCount);
+            
+            if (res.onePhase && dateCount + 4 <= l)
+            {
+                res.record = payload[2 + dateCount];
+                res.lowWater = payload[3 + dateCount];
+            }
+        }
+        else
+        {
+            res.isRequest = false;
+            res.action = ActionType(payload[0]);
+            if (p.header()->length >= 2 * sizeof(int))
+            {
+                res.ackRequired = (payload[1] != 0);
+            }
+        }
+        
+        return res;
+    }
+};
+
+struct PendingReply
+{
+    uint64_t lsn;
+    uint64_t startedAt;
+    MessageType type;
+    vector<int> requestIds;
+    vector<VoteStatus> votes;
+};
+
+enum ShardJobType
+{
+    JOB_PREPARE = 0,
+    JOB_ONE_PHASE = 1,
+    JOB_COMMIT = 2,
+    JOB_ABORT = 3,
+    JOB_RELEASE = 4
+};
+
+// The work for one message, split across the shards its dates fall in.
+// Whichever shard finishes the last task completes the job.
+struct ShardJob
+{
+    ShardJobType type;
+    bool onePhase;
+    MessageType replyType;
+    bool replyRequired;
+    vector<Response> requests;
+    vector<VoteStatus> votes;
+    
+    // Dates each request holds reservations on, to release them again
+    // when another shard could not reserve
+    vector<DateList> reservedDates;
+    
+    int remaining;
+    uint64_t startedAt;
+    pthread_mutex_t lock;
+};
+
+// The dates of one request of a job that belong to one shard
+struct ShardTask
+{
+    ShardJob * job;
+    int index;
+    DateList dates;
+};
+
+// Reserve, sell and release records are written by a shard as it changes
+// its dates. The other records settle a whole transaction afterwards.
+enum WalRecordType
+{
+    WAL_PREPARE = 1,
+    WAL_COMMIT = 2,
+    WAL_ABORT = 3,
+    WAL_ONE_PHASE = 4,
+    WAL_RESERVE = 5,
+    WAL_SELL = 6,
+    WAL_RELEASE = 7
+};
+
+// Each log record is this header followed by length bytes of payload
+struct WalRecord
+{
+    uint32_t type;
+    uint32_t length;
+    uint64_t transactionId;
+    uint64_t lsn;
+    uint32_t checksum;
+    uint32_t reserved;
+};
+
+struct WalEntry
+{
+    WalRecordType type;
+    uint64_t transactionId;
+    uint64_t lsn;
+    vector<int> payload;
+};
+
+// The dates a transaction's shard records changed, for finishing it after
+// a failure cut it short
+struct ReplayChanges
+{
+    int tickets;
+    set<int> reserved;
+    set<int> sold;
+    set<int> released;
+};
+
+// A checkpoint file is this header, the inventory records, each prepared
+// request as
+// [id, tickets, dateCount, dates...], then each kept one phase outcome as
+// [id, record, vote]
+struct CheckpointHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t lsn;
+    uint64_t lastTransactionId;
+    uint32_t inventoryCount;
+    uint32_t preparedCount;
+    uint32_t length;
+    uint32_t checksum;
+    uint32_t onePhaseCount;
+    uint32_t reserved;
+};
+
+const uint32_t CHECKPOINT_MAGIC = 0x54504b43;
+const uint32_t CHECKPOINT_VERSION = 5;
+
+// One bookable date. Tickets still available are capacity - reserved - sold.
+struct InventoryRecord
+{
+    int32_t resourceId;
+    int32_t capacity;
+    int32_t reserved;
+    int32_t sold;
+    
+    int available()
+    {
+        return capacity - reserved - sold;
+    }
+};
+
+// A mapped inventory file is this header followed by count records
+struct InventoryFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+const uint32_t INVENTORY_MAGIC = 0x564e4950;
+const uint32_t INVENTORY_VERSION = 1;
+
+// ** Global Functions **
+
+// Split string by a delimeter into a vector of tokens
+vector<string> split(string fullString, char delimiter)
+{
+    vector<string> splits;
+    stringstream stream(fullString);
+    string token;
+    
+    while(getline(stream, token, delimiter))
+    {
+        splits.push_back(token);
+    }
+    
+    return splits;
+}
+
+// FNV-1a, enough to spot a torn or garbled record
+uint32_t checksum(const char * data, size_t length, uint32_t hash)
+{
+    for (size_t i = 0;i < length;i ++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Bounded queue that any number of threads can push to and pop from without
+// a lock. Each slot's sequence number says whether it is waiting for a push
+// or a pop on the current lap, so a push or pop is one compare-and-swap on
+// the tail or head plus one store, and nothing is allocated after creation.
+template <typename T>
+class RingBuffer
+{
+private:
+    
+    // ** Class Parameters **
+    
+    struct Slot
+    {
+        atomic<size_t> sequence;
+        T value;
+    };
+    
+    Slot * slots;
+    size_t mask;
+    
+    // Apart so producers and consumers don't fight over one cache line
+    alignas(CACHE_LINE_SIZE) atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) atomic<size_t> tail;
+    alignas(CACHE_LINE_SIZE) atomic<int> waiters;
+    
+    // Bumped by wake, so a waiter can tell it was woken with nothing queued
+    atomic<uint64_t> wakeups;
+    
+    pthread_mutex_t waitLock;
+    pthread_cond_t changed;
+    
+    // ** Private Functions **
+    
+    // Wake anyone blocked in a wait, skipping the lock when nobody is
+    void notify()
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (waiters.load() > 0)
+        {
+            pthread_mutex_lock(&waitLock);
+            pthread_cond_broadcast(&changed);
+            pthread_mutex_unlock(&waitLock);
+        }
+    }
+    
+    // Block until the buffer has items (or space), wake is called after
+    // wakeCount was read, or timeoutMs passes. A negative timeout waits for
+    // as long as it takes.
+    bool waitFor(bool forItems, int timeoutMs, uint64_t wakeCount)
+    {
+        timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        if (timeoutMs >= 0)
+        {
+            deadline.tv_sec += timeoutMs / 1000;
+            deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec ++;
+                deadline.tv_nsec -= 1000000000;
+            }
+        }
+        
+        waiters ++;
+        pthread_mutex_lock(&waitLock);
+        bool ready = (forItems ? !empty() : freeSpace() > 0);
+        while (!ready && wakeups.load() == wakeCount)
+        {
+            if (timeoutMs < 0)
+            {
+                pthread_cond_wait(&changed, &waitLock);
+            }
+            else if (pthread_cond_timedwait(&changed, &waitLock, &deadline) != 0)
+            {
+                ready = (forItems ? !empty() : freeSpace() > 0);
+                break;
+            }
+            ready = (forItems ? !empty() : freeSpace() > 0);
+        }
+        pthread_mutex_unlock(&waitLock);
+        waiters --;
+        
+        return ready;
+    }
+    
+    bool tryPush(T & item)
+    {
+        size_t pos = tail.load(memory_order_relaxed);
+        while (true)
+        {
+            Slot & slot = slots[pos & mask];
+            size_t sequence = slot.sequence.load(memory_order_acquire);
+            intptr_t lap = (intptr_t)sequence - (intptr_t)pos;
+            
+            if (lap == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    slot.value = move(item);
+                    slot.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (lap < 0)
+            {
+                // Full, the slot still holds last lap's item
+                return false;
+            }
+            else
+            {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+    
+    bool tryPop(T & item)
+    {
+        size_t pos = head.load(memory_order_relaxed);
+        while (true)
+        {
+            Slot & slot = slots[pos & mask];
+            size_t sequence = slot.sequence.load(memory_order_acquire);
+            intptr_t lap = (intptr_t)sequence - (intptr_t)(pos + 1);
+            
+            if (lap == 0)
+            {
+                if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    item = move(slot.value);
+                    slot.sequence.store(pos + mask + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (lap < 0)
+            {
+                // Empty, the slot hasn't been filled this lap
+                return false;
+            }
+            else
+            {
+                pos = head.load(memory_order_relaxed);
+            }
+        }
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    // Capacity is rounded up to a power of two
+    RingBuffer(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        
+        slots = new Slot[size];
+        mask = size - 1;
+        for (size_t i = 0;i < size;i ++)
+        {
+            slots[i].sequence.store(i, memory_order_relaxed);
+        }
+        
+        head.store(0);
+        tail.store(0);
+        waiters.store(0);
+        wakeups.store(0);
+        pthread_mutex_init(&waitLock, NULL);
+        
+        // Timed waits measure against the monotonic clock, so a wall clock
+        // step neither cuts them short nor stretches them
+        pthread_condattr_t attributes;
+        pthread_condattr_init(&attributes);
+        pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+        pthread_cond_init(&changed, &attributes);
+        pthread_condattr_destroy(&attributes);
+    }
+    
+    ~RingBuffer()
+    {
+        delete [] slots;
+        pthread_mutex_destroy(&waitLock);
+        pthread_cond_destroy(&changed);
+    }
+    
+    // Both return false instead of waiting when the buffer is full or empty
+    bool push(T & item)
+    {
+        bool pushed = tryPush(item);
+        if (pushed)
+        {
+            notify();
+        }
+        return pushed;
+    }
+    
+    bool pop(T & item)
+    {
+        bool popped = tryPop(item);
+        if (popped)
+        {
+            notify();
+        }
+        return popped;
+    }
+    
+    // Push items from the front of the vector until it is empty or the
+    // buffer is full, and return how many went in
+    int pushBatch(vector<T> & items)
+    {
+        int count = 0;
+        while (count < items.size() && tryPush(items[count]))
+        {
+            count ++;
+        }
+        items.erase(items.begin(), items.begin() + count);
+        
+        if (count > 0)
+        {
+            notify();
+        }
+        return count;
+    }
+    
+    // Append up to maxItems items to the vector and return how many
+    int popBatch(vector<T> & items, int maxItems)
+    {
+        int count = 0;
+        T item;
+        while (count < maxItems && tryPop(item))
+        {
+            items.push_back(move(item));
+            count ++;
+        }
+        
+        if (count > 0)
+        {
+            notify();
+        }
+        return count;
+    }
+    
+    // Exact only when no push or pop is in flight, but a single producer
+    // can always count on at least freeSpace() more pushes succeeding
+    size_t size()
+    {
+        size_t tailPos = tail.load();
+        size_t headPos = head.load();
+        return (tailPos > headPos ? tailPos - headPos : 0);
+    }
+    
+    size_t freeSpace()
+    {
+        size_t used = size();
+        return (used > mask ? 0 : mask + 1 - used);
+    }
+    
+    bool empty()
+    {
+        return size() == 0;
+    }
+    
+    bool waitForItems(int timeoutMs)
+    {
+        return waitFor(true, timeoutMs, wakeups.load());
+    }
+    
+    // Also returns early once wake is called after wakeCount was read, so
+    // a consumer that checks other work first loses no wakeup in between
+    bool waitForItems(int timeoutMs, uint64_t wakeCount)
+    {
+        return waitFor(true, timeoutMs, wakeCount);
+    }
+    
+    bool waitForSpace(int timeoutMs)
+    {
+        return waitFor(false, timeoutMs, wakeups.load());
+    }
+    
+    uint64_t wakeCount()
+    {
+        return wakeups.load();
+    }
+    
+    // End every wait in progress, whether or not anything was queued
+    void wake()
+    {
+        wakeups ++;
+        notify();
+    }
+};
+
+// Timer wheels tick once a millisecond. Each level has 64 slots, and a
+// slot on one level spans a whole lap of the level below, so four levels
+// reach about four and a half hours.
+const int TIMER_LEVELS = 4;
+const int TIMER_BITS = 6;
+const int TIMER_SLOTS = 1 << TIMER_BITS;
+
+// Hierarchical timer wheel on the monotonic clock. A timer is filed in the
+// lowest level whose lap covers its deadline, and moves down a level each
+// time the wheel reaches its slot, so scheduling is constant time and a
+// tick only looks at the timers that are due. Timers are never cancelled,
+// owners tell a stale one apart when it fires.
+template <typename T>
+class TimerWheel
+{
+private:
+    
+    // ** Class Parameters **
+    
+    struct Timer
+    {
+        uint64_t deadline;
+        T item;
+    };
+    
+    vector<Timer> slots[TIMER_LEVELS][TIMER_SLOTS];
+    
+    // Every tick up to current has been expired
+    uint64_t current;
+    size_t count = 0;
+    
+    // ** Private Functions **
+    
+    // File a timer no sooner than earliest. Anything past the top level's
+    // lap waits in its last slot to be filed again.
+    void file(const Timer & timer, uint64_t earliest)
+    {
+        uint64_t due = max(timer.deadline, earliest);
+        uint64_t span = (uint64_t) 1 << (TIMER_BITS * TIMER_LEVELS);
+        due = min(due, current + span - 1);
+        
+        int level = 0;
+        while (level < TIMER_LEVELS - 1 && due - current >= ((uint64_t) 1 << (TIMER_BITS * (level + 1))))
+        {
+            level ++;
+        }
+        
+        slots[level][(due >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)].push_back(timer);
+    }
+    
+    // Move the timers in a level's current slot down the wheel
+    void cascade(int level)
+    {
+        vector<Timer> timers;
+        timers.swap(slots[level][(current >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)]);
+        for (int i = 0;i < timers.size();i ++)
+        {
+            file(timers[i], current);
+        }
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    TimerWheel()
+    {
+        current = monotonicTime() / 1000000;
+    }
+    
+    // Milliseconds on the monotonic clock
+    static uint64_t now()
+    {
+        return monotonicTime() / 1000000;
+    }
+    
+    void schedule(const T & item, uint64_t deadline)
+    {
+        Timer timer;
+        timer.deadline = deadline;
+        timer.item = item;
+        
+        // The current tick has already been expired
+        file(timer, current + 1);
+        count ++;
+    }
+    
+    // Tick up to time, adding the items of every timer due by then to expired
+    void advance(uint64_t time, vector<T> & expired)
+    {
+        if (count == 0)
+        {
+            current = max(current, time);
+            return;
+        }
+        
+        while (current < time)
+        {
+            current ++;
+            
+            // Higher levels first, so their timers can fall all the way down
+            for (int level = TIMER_LEVELS - 1;level > 0;level --)
+            {
+                if ((current & (((uint64_t) 1 << (TIMER_BITS * level)) - 1)) == 0)
+                {
+                    cascade(level);
+                }
+            }
+            
+            vector<Timer> & due = slots[0][current & (TIMER_SLOTS - 1)];
+            for (int i = 0;i < due.size();i ++)
+            {
+                expired.push_back(due[i].item);
+            }
+            count -= due.size();
+            due.clear();
+        }
+    }
+    
+    // The earliest time a timer could fire, exact for timers due within
+    // 64ms and otherwise when the next one moves down a level. Zero if
+    // there are none.
+    uint64_t nextExpiry()
+    {
+        if (count == 0)
+        {
+            return 0;
+        }
+        
+        uint64_t earliest = UINT64_MAX;
+        for (int level = 0;level < TIMER_LEVELS;level ++)
+        {
+            uint64_t lap = current >> (TIMER_BITS * level);
+            for (int i = 1;i <= TIMER_SLOTS;i ++)
+            {
+                if (!slots[level][(lap + i) & (TIMER_SLOTS - 1)].empty())
+                {
+                    earliest = min(earliest, (lap + i) << (TIMER_BITS * level));
+                    break;
+                }
+            }
+        }
+        return earliest;
+    }
+    
+    size_t size()
+    {
+        return count;
+    }
+    
+    void clear()
+    {
+        for (int level = 0;level < TIMER_LEVELS;level ++)
+        {
+            for (int i = 0;i < TIMER_SLOTS;i ++)
+            {
+                slots[level][i].clear();
+            }
+        }
+        count = 0;
+    }
+};
+
+// Histograms split each power of two into 16 linear buckets, so a value is
+// reported to within 1/16 of itself, and values below 32 are exact
+const int HISTOGRAM_SUB_BITS = 4;
+const int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+const int HISTOGRAM_BUCKETS = (65 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS;
+
+// Bucket bounds, in microseconds, of the histograms served to Prometheus
+const int PROMETHEUS_BOUNDS = 16;
+const uint64_t PROMETHEUS_BOUNDS_US[PROMETHEUS_BOUNDS] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+
+// Log-linear latency histogram in the style of HdrHistogram. Recording is
+// a few relaxed atomic adds, so any thread can record and a reader can
+// take percentiles at any time without stopping the writers.
+class LatencyHistogram
+{
+private:
+    
+    // ** Class Parameters **
+    
+    atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    atomic<uint64_t> total;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> maximum;
+    
+    // ** Private Functions **
+    
+    static int bucketFor(uint64_t value)
+    {
+        if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+        {
+            return (int) value;
+        }
+        
+        int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+        return shift * HISTOGRAM_SUB_BUCKETS + (int)(value >> shift);
+    }
+    
+    // Largest value that lands in a bucket
+    static uint64_t bucketLimit(int bucket)
+    {
+        if (bucket < 2 * HISTOGRAM_SUB_BUCKETS)
+        {
+            return bucket;
+        }
+        
+        int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+        uint64_t low = (uint64_t)(bucket - shift * HISTOGRAM_SUB_BUCKETS) << shift;
+        return low + (((uint64_t) 1 << shift) - 1);
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    LatencyHistogram()
+    {
+        for (int i = 0;i < HISTOGRAM_BUCKETS;i ++)
+        {
+            buckets[i] = 0;
+        }
+        total = 0;
+        sum = 0;
+        maximum = 0;
+    }
+    
+    void record(uint64_t value)
+    {
+        buckets[bucketFor(value)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(value, memory_order_relaxed);
+        
+        uint64_t seen = maximum.load(memory_order_relaxed);
+        while (value > seen && !maximum.compare_exchange_weak(seen, value, memory_order_relaxed))
+        {
+        }
+    }
+    
+    uint64_t count()
+    {
+        return total.load(memory_order_relaxed);
+    }
+    
+    uint64_t getSum()
+    {
+        return sum.load(memory_order_relaxed);
+    }
+    
+    uint64_t getMax()
+    {
+        return maximum.load(memory_order_relaxed);
+    }
+    
+    // Smallest bucket limit that at least fraction of the values are under.
+    // Values recorded while this runs may or may not be counted.
+    uint64_t percentile(double fraction)
+    {
+        uint64_t counts[HISTOGRAM_BUCKETS];
+        uint64_t seen = 0;
+        for (int i = 0;i < HISTOGRAM_BUCKETS;i ++)
+        {
+            counts[i] = buckets[i].load(memory_order_relaxed);
+            seen += counts[i];
+        }
+        
+        uint64_t rank = max((uint64_t) 1, (uint64_t)(fraction * seen + 0.5));
+        uint64_t below = 0;
+        for (int i = 0;i < HISTOGRAM_BUCKETS && seen > 0;i ++)
+        {
+            below += counts[i];
+            if (below >= rank)
+            {
+                return min(bucketLimit(i), getMax());
+            }
+        }
+        return 0;
+    }
+    
+    // Prometheus histogram samples for a histogram of microseconds, in
+    // seconds. A bound counts the buckets that fall entirely under it.
+    string prometheus(string name, string labels)
+    {
+        uint64_t counts[HISTOGRAM_BUCKETS];
+        uint64_t seen = 0;
+        for (int i = 0;i < HISTOGRAM_BUCKETS;i ++)
+        {
+            counts[i] = buckets[i].load(memory_order_relaxed);
+            seen += counts[i];
+        }
+        
+        string bucketLabels = (labels.empty() ? "{" : "{" + labels + ",");
+        string sampleLabels = (labels.empty() ? "" : "{" + labels + "}");
+        
+        ostringstream text;
+        text.precision(12);
+        int bucket = 0;
+        uint64_t below = 0;
+        for (int i = 0;i < PROMETHEUS_BOUNDS;i ++)
+        {
+            while (bucket < HISTOGRAM_BUCKETS && bucketLimit(bucket) <= PROMETHEUS_BOUNDS_US[i])
+            {
+                below += counts[bucket ++];
+            }
+            text << name << "_bucket" << bucketLabels << "le=\"" << PROMETHEUS_BOUNDS_US[i] / 1e6 << "\"} " << below << "\n";
+        }
+        text << name << "_bucket" << bucketLabels << "le=\"+Inf\"} " << seen << "\n";
+        text << name << "_sum" << sampleLabels << " " << getSum() / 1e6 << "\n";
+        text << name << "_count" << sampleLabels << " " << seen << "\n";
+        return text.str();
+    }
+    
+    // "count N mean N p50 N p90 N p99 N p999 N max N"
+    string summary()
+    {
+        uint64_t n = count();
+        ostringstream text;
+        text << "count " << n << " mean " << (n > 0 ? getSum() / n : 0) << " p50 " << percentile(0.5) << " p90 " << percentile(0.9)
+             << " p99 " << percentile(0.99) << " p999 " << percentile(0.999) << " max " << getMax();
+        return text.str();
+    }
+};
+
+// How long each log flush took, in microseconds, and how many records it
+// made durable
+struct LogMetrics
+{
+    LatencyHistogram flushTime;
+    LatencyHistogram flushRecords;
+};
+
+// Everything the stats command reports. Service times are in microseconds,
+// from the process thread taking a message to its reply being sent. Each
+// value is written by the thread that sees the event and read by the
+// others without locking.
+struct ParticipantMetrics
+{
+    LatencyHistogram prepareTime;
+    LatencyHistogram decisionTime;
+    LogMetrics wal;
+    
+    atomic<uint64_t> yesVotes{0};
+    atomic<uint64_t> noVotes{0};
+    atomic<uint64_t> readOnlyVotes{0};
+    atomic<uint64_t> commits{0};
+    atomic<uint64_t> aborts{0};
+    atomic<uint64_t> onePhaseCommits{0};
+    atomic<uint64_t> decisionTimeouts{0};
+    
+    atomic<int> prepared{0};
+    atomic<int> shardTasks{0};
+    atomic<int> pendingReplies{0};
+};
+
+// Serves the metrics over HTTP on a loopback port or a Unix socket, one
+// request per connection, from its own thread. The text comes from a
+// callback that only reads the metrics, so a scrape never blocks the node.
+class MetricsServer
+{
+private:
+    
+    // ** Class Parameters **
+    
+    pthread_t serverThread;
+    int listenSocket;
+    string address;
+    
+    string (*render)(void *);
+    void * renderContext;
+    
+    // ** Private Functions **
+    
+    void listenOnPort(int port)
+    {
+        sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_port = htons(port);
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        
+        int reuse = 1;
+        listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (::bind(listenSocket, (sockaddr *)&local, sizeof(local)) != 0 || listen(listenSocket, 16) != 0)
+        {
+            cout << "Error - Could not serve metrics on " << address << " " << errno << endl;
+            exit(1);
+        }
+    }
+    
+    void listenOnSocket(string path)
+    {
+        sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(local.sun_path))
+        {
+            cout << "Error - Metrics socket path too long " << path << endl;
+            exit(1);
+        }
+        strcpy(local.sun_path, path.c_str());
+        
+        // Left behind by an earlier run
+        unlink(path.c_str());
+        
+        listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (::bind(listenSocket, (sockaddr *)&local, sizeof(local)) != 0 || listen(listenSocket, 16) != 0)
+        {
+            cout << "Error - Could not serve metrics on " << address << " " << errno << endl;
+            exit(1);
+        }
+    }
+    
+    // Function to start the metrics thread
+    static void * serverThreadCaller(void * context)
+    {
+        return ((MetricsServer *)context)->serveRequests(NULL);
+    }
+    
+    // Threaded function that answers one scrape at a time
+    void * serveRequests(void *)
+    {
+        while (true)
+        {
+            int client = accept(listenSocket, NULL, NULL);
+            if (client < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                {
+                    continue;
+                }
+                break;
+            }
+            
+            answerRequest(client);
+            close(client);
+        }
+        
+        pthread_exit(NULL);
+    }
+    
+    // Read the request head and send the metrics, whatever was asked for.
+    // A client that stalls is dropped after a second.
+    void answerRequest(int client)
+    {
+        timeval timeout;
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        
+        string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == string::npos && request.find("\n\n") == string::npos && request.size() < 8192)
+        {
+            ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                break;
+            }
+            request.append(buffer, n);
+        }
+        
+        string body = render(renderContext);
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(body.size()) +
+                          "\r\nConnection: close\r\n\r\n" + (request.compare(0, 5, "HEAD ") == 0 ? "" : body);
+        
+        size_t sent = 0;
+        while (sent < response.size())
+        {
+            ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                break;
+            }
+            sent += n;
+        }
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    // Listen on 127.0.0.1:port, or on the Unix socket at path if one is given
+    MetricsServer(int port, string path, string (*metricsCallback)(void *), void * context)
+    {
+        render = metricsCallback;
+        renderContext = context;
+        
+        if (!path.empty())
+        {
+            address = path;
+            listenOnSocket(path);
+        }
+        else
+        {
+            address = "127.0.0.1:" + to_string(port);
+            listenOnPort(port);
+        }
+        
+        if (int s = pthread_create(&serverThread, NULL, &MetricsServer::serverThreadCaller, this))
+        {
+            cout << "Error creating metrics thread. Code - " << s << endl;
+            exit(1);
+        }
+        pthread_detach(serverThread);
+        
+        cout << "Serving metrics on " << address << endl;
+    }
+};
+
+class CommunicationSubstrate
+{
+private:
+    
+    // ** Class Parameters **
+    
+    pthread_t reactorThread;
+    
+    int epollFd;
+    int wakeFd;
+    
+    // Frames the reactor has read, and packets queued for it to send
+    RingBuffer<Packet> inputBuffer;
+    RingBuffer<Packet> outputBuffer;
+    vector<Packet> outgoing;
+    
+    sockaddr_in serverSocketInfo;
+    sockaddr_in coordinatorInfo;
+    
+    int coordinatorSocket;
+    int messageSocket;
+    
+    Connection coordinator;
+    
+    string participantAddress;
+    
+    RingBuffer<Response> responseBuffer;
+    
+    // Responses decoded while responseBuffer was full. Input stays in the
+    // read buffer until the participant makes room.
+    deque<Response> heldResponses;
+    atomic<bool> inputStalled;
+    
+    // Bytes written to and read from every connection
+    atomic<uint64_t> totalBytesSent{0};
+    atomic<uint64_t> totalBytesRecieved{0};
+    
+    // ** Private Functions **
+    
+    void populateIPAddress(sockaddr_in * address, string addressInfo)
+    {
+        address->sin_family = AF_INET;
+        vector<string> addressParts = split(addressInfo, ':');
+        address->sin_port = htons(stoi(addressParts[1]));
+        inet_pton(AF_INET, addressParts[0].c_str(), &address->sin_addr);
+    }
+    
+    void connectToCoordinator(bool fresh)
+    {
+        if (fresh)
+        {
+            int reuse = 1;
+            setsockopt(coordinatorSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            
+            populateIPAddress(&serverSocketInfo, participantAddress);
+            if (::bind(coordinatorSocket, (sockaddr *)&serverSocketInfo, sizeof(serverSocketInfo)) == -1)
+            {
+                cout << "Bind error " << errno << endl;
+                exit(1);
+            }
+            
+            if (listen(coordinatorSocket, 0) == -1)
+            {
+                cout << "Listen error" << errno << endl;
+                exit(1);
+            }
+            
+            cout << "Bound on address " << participantAddress << endl;
+        }
+        cout << "Waiting for connection from coordinator..." << endl;
+        
+        socklen_t size = sizeof(coordinatorInfo);
+        messageSocket = accept(coordinatorSocket, (sockaddr *)&coordinatorInfo, &size);
+        if (messageSocket == -1)
+        {
+            cout << "Error accepting connection" << endl;
+            exit(1);
+        }
+        
+        registerConnection(messageSocket);
+        
+        cout << "Coordinator connected." << endl;
+    }
+    
+    // Make the coordinator socket non-blocking and watch it for input
+    void registerConnection(int socket)
+    {
+        fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+        
+        coordinator.socket = socket;
+        coordinator.name = "coordinator";
+        coordinator.readBuffer.clear();
+        coordinator.writeBuffer.clear();
+        coordinator.writeBlocked = false;
+        
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = socket;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event);
+    }
+    
+    // Only ask for write readiness while output is backed up
+    void watchConnection(Connection & conn)
+    {
+        epoll_event event;
+        event.events = EPOLLIN | (conn.writeBlocked ? EPOLLOUT : 0);
+        event.data.fd = conn.socket;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.socket, &event);
+    }
+    
+    // Write as much pending output as the socket will take
+    void flushConnection(Connection & conn)
+    {
+        while (!conn.writeBuffer.empty())
+        {
+            ssize_t bytesSent = send(conn.socket, conn.writeBuffer.data(), conn.writeBuffer.size(), 0);
+            if (bytesSent < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    // Nothing queued can arrive whole any more
+                    cout << "Error - Could not send to coordinator " << errno << endl;
+                    conn.writeBuffer.clear();
+                    dropConnection(conn);
+                    return;
+                }
+                break;
+            }
+            conn.writeBuffer.erase(0, bytesSent);
+            totalBytesSent.fetch_add(bytesSent, memory_order_relaxed);
+        }
+        
+        bool blocked = !conn.writeBuffer.empty();
+        if (blocked != conn.writeBlocked)
+        {
+            conn.writeBlocked = blocked;
+            watchConnection(conn);
+        }
+    }
+    
+    // Move queued packets onto the connection and send them
+    void processOutput()
+    {
+        outgoing.clear();
+        outputBuffer.popBatch(outgoing, RING_CAPACITY);
+        
+        for (int i = 0;i < outgoing.size();i ++)
+        {
+            Packet & p = outgoing[i];
+            if (p.socket == coordinator.socket)
+            {
+                coordinator.writeBuffer.append(p.data, p.length);
+            }
+            p.release();
+        }
+        
+        flushConnection(coordinator);
+    }
+    
+    // Decode recieved packets into responses, holding them while there is no room
+    void processInput()
+    {
+        while (!heldResponses.empty() && responseBuffer.push(heldResponses.front()))
+        {
+            heldResponses.pop_front();
+        }
+        
+        Packet p;
+        while (heldResponses.empty() && inputBuffer.pop(p))
+        {
+            Response res = Response::createFromPacket(p);
+            if (!responseBuffer.push(res))
+            {
+                heldResponses.push_back(res);
+            }
+            p.release();
+        }
+        
+        inputStalled = !heldResponses.empty();
+    }
+    
+    // Decode the input held back while the participant was behind
+    void resumeInput()
+    {
+        processInput();
+        
+        if (!inputStalled && !coordinator.readBuffer.empty())
+        {
+            if (!decodeFrames(coordinator))
+            {
+                dropConnection(coordinator);
+            }
+            processInput();
+        }
+    }
+    
+    void dropConnection(Connection & conn)
+    {
+        cout << "Lost connection to coordinator" << endl;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.socket, NULL);
+    }
+    
+    // Split every complete frame off the front of the read buffer
+    bool decodeFrames(Connection & conn)
+    {
+        size_t offset = 0;
+        
+        while (conn.readBuffer.size() - offset >= sizeof(FrameHeader))
+        {
+            FrameHeader header;
+            memcpy(&header, conn.readBuffer.data() + offset, sizeof(header));
+            
+            if (header.version != PROTOCOL_VERSION || header.length > MAX_FRAME_PAYLOAD)
+            {
+                cout << "Error - Malformed frame from coordinator" << endl;
+                return false;
+            }
+            
+            size_t frameLength = sizeof(FrameHeader) + header.length;
+            if (conn.readBuffer.size() - offset < frameLength)
+            {
+                break;
+            }
+            
+            // The finish packet is handed to the participant so it can shut down cleanly
+            if (system_status == NORMAL || header.type == MSG_FINISH)
+            {
+                Packet packet = Packet::createFromRawData(conn.readBuffer.data() + offset, conn.socket, (int) frameLength);
+                bool queued = inputBuffer.push(packet);
+                if (!queued)
+                {
+                    // Make room by decoding what is already queued
+                    processInput();
+                    queued = inputBuffer.push(packet);
+                }
+                
+                if (!queued)
+                {
+                    // Leave the rest in the read buffer until there is room
+                    packet.release();
+                    inputStalled = true;
+                    break;
+                }
+            }
+            
+            offset += frameLength;
+        }
+        
+        conn.readBuffer.erase(0, offset);
+        return true;
+    }
+    
+    // Read everything available, then decode all complete frames
+    void recieveDataFromSocket(Connection & conn, char * buffer)
+    {
+        bool open = true;
+        
+        while (open)
+        {
+            ssize_t bytesRecieved = recv(conn.socket, buffer, RECIEVE_BUFFER_SIZE, 0);
+            if (bytesRecieved > 0)
+            {
+                conn.readBuffer.append(buffer, bytesRecieved);
+                totalBytesRecieved.fetch_add(bytesRecieved, memory_order_relaxed);
+            }
+            else if (bytesRecieved < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (bytesRecieved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            else
+            {
+                open = false;
+            }
+        }
+        
+        if (!decodeFrames(conn))
+        {
+            open = false;
+        }
+        processInput();
+        
+        if (!open)
+        {
+            dropConnection(conn);
+        }
+    }
+    
+    // Function to start thread C
+    static void *reactorThreadCaller(void * context)
+    {
+        return ((CommunicationSubstrate *)context)->runReactor(NULL);
+    }
+    
+    // Threaded function to wait on socket readiness and outgoing traffic
+    void * runReactor(void *)
+    {
+        char * buffer = new char[RECIEVE_BUFFER_SIZE];
+        epoll_event events[16];
+        
+        while (system_status != FINISHED)
+        {
+            int eventCount = epoll_wait(epollFd, events, 16, -1);
+            
+            for (int i = 0;i < eventCount;i ++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == wakeFd)
+                {
+                    uint64_t wakeups;
+                    read(wakeFd, &wakeups, sizeof(wakeups));
+                    processOutput();
+                    if (inputStalled)
+                    {
+                        resumeInput();
+                    }
+                    continue;
+                }
+                
+                if (fd != coordinator.socket)
+                {
+                    continue;
+                }
+                
+                if (events[i].events & EPOLLOUT)
+                {
+                    flushConnection(coordinator);
+                }
+                
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                {
+                    recieveDataFromSocket(coordinator, buffer);
+                }
+            }
+        }
+        
+        delete [] buffer;
+        pthread_exit(NULL);
+    }
+    
+    void wakeReactor()
+    {
+        uint64_t wakeup = 1;
+        write(wakeFd, &wakeup, sizeof(wakeup));
+    }
+    
+    // Wait for the reactor to make room when the output buffer is full
+    void queuePacket(Packet p)
+    {
+        while (!outputBuffer.push(p))
+        {
+            wakeReactor();
+            outputBuffer.waitForSpace(10);
+        }
+        
+        wakeReactor();
+    }
+    
+    void startSubstrate()
+    {
+        cout << "Starting communication substrate..." << endl;
+        
+        if (int s = pthread_create(&reactorThread, NULL, &CommunicationSubstrate::reactorThreadCaller, this))
+        {
+            cout << "Error creating reactor thread. Code - " << s << endl;
+            exit(1);
+        }
+        
+        cout << "Communication substrate started." << endl;
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    CommunicationSubstrate(string socketAddress) :
+        inputBuffer(RING_CAPACITY), outputBuffer(RING_CAPACITY), responseBuffer(RING_CAPACITY)
+    {
+        inputStalled = false;
+        
+        epollFd = epoll_create1(0);
+        wakeFd = eventfd(0, EFD_NONBLOCK);
+        
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = wakeFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+        
+        coordinatorSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        participantAddress = socketAddress;
+        connectToCoordinator(true);
+        startSubstrate();
+    }
+    
+    // Wait up to timeoutMs for the next message, an empty response if none
+    // comes
+    Response waitForResponse(int timeoutMs)
+    {
+        Response r;
+        
+        uint64_t deadline = monotonicTime() + (uint64_t) timeoutMs * 1000000;
+        while (true)
+        {
+            // Read before checking, so a wake from here on ends the wait
+            uint64_t wakeCount = responseBuffer.wakeCount();
+            if (system_status != NORMAL)
+            {
+                break;
+            }
+            
+            if (responseBuffer.pop(r))
+            {
+                if (inputStalled)
+                {
+                    // The reactor is waiting for room to decode more
+                    wakeReactor();
+                }
+                return r;
+            }
+            
+            uint64_t now = monotonicTime();
+            if (now >= deadline)
+            {
+                return Response();
+            }
+            
+            // Sleep until the reactor queues a message
+            responseBuffer.waitForItems((int)((deadline - now + 999999) / 1000000), wakeCount);
+        }
+        
+        return Response();
+    }
+    
+    // Wake a thread blocked in waitForResponse
+    void wake()
+    {
+        responseBuffer.wake();
+    }
+    
+    // Queue depths, safe to read from any thread
+    size_t inputQueued()
+    {
+        return inputBuffer.size();
+    }
+    
+    size_t outputQueued()
+    {
+        return outputBuffer.size();
+    }
+    
+    size_t responsesQueued()
+    {
+        return responseBuffer.size();
+    }
+    
+    uint64_t getBytesSent()
+    {
+        return totalBytesSent.load(memory_order_relaxed);
+    }
+    
+    uint64_t getBytesRecieved()
+    {
+        return totalBytesRecieved.load(memory_order_relaxed);
+    }
+    
+    void sendVote(VoteStatus vote, int requestId)
+    {
+        cout << "Sending " << (vote == VOTE_YES ? "yes vote for " : (vote == VOTE_NO ? "no vote for " : "read only vote for ")) << requestId << endl;
+        
+        Packet votePacket = Packet::createVotePacket(vote, messageSocket, requestId);
+        queuePacket(votePacket);
+    }
+    
+    void sendVotes(vector<int> & requestIds, vector<VoteStatus> & votes)
+    {
+        cout << "Sending " << votes.size() << " votes from " << requestIds[0] << endl;
+        
+        Packet votePacket = Packet::createVoteBatchPacket(messageSocket, requestIds, votes);
+        queuePacket(votePacket);
+    }
+    
+    void sendAck(int requestId)
+    {
+        cout << "Sending acknowledgement for id " << requestId << endl;
+        
+        Packet ackPacket = Packet::createAckPacket(messageSocket, requestId);
+        queuePacket(ackPacket);
+    }
+    
+    void sendInquiry(int requestId)
+    {
+        cout << "Sending inquiry for id " << requestId << endl;
+        
+        Packet inquiryPacket = Packet::createInquiryPacket(messageSocket, requestId);
+        queuePacket(inquiryPacket);
+    }
+    
+    void stopSubstrate()
+    {
+        close(coordinatorSocket);
+        close(messageSocket);
+    }
+    
+    void failSystem()
+    {
+        vector<Packet> packets;
+        outputBuffer.popBatch(packets, RING_CAPACITY);
+        inputBuffer.popBatch(packets, RING_CAPACITY);
+        for (int i = 0;i < packets.size();i ++)
+        {
+            packets[i].release();
+        }
+        
+        vector<Response> responses;
+        responseBuffer.popBatch(responses, RING_CAPACITY);
+        
+        cout << "Communication Substrate failed." << endl;
+    }
+    
+    void reconnect()
+    {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, messageSocket, NULL);
+        close(messageSocket);
+        connectToCoordinator(false);
+    }
+};
+
+class InventoryStore
+{
+private:
+    
+    // ** Class Parameters **
+    
+    // Records live on the heap, or in a mapped file when mapped is set
+    vector<InventoryRecord> heapRecords;
+    InventoryRecord * records = NULL;
+    size_t count = 0;
+    
+    bool mapped = false;
+    int fd = -1;
+    void * mapping = NULL;
+    size_t mappingLength = 0;
+    
+    // Set when the CPU can check eight dates at a time
+    bool wide = false;
+    
+    // ** Private Functions **
+    
+    void detectWide()
+    {
+#ifdef HAVE_X86_SIMD
+        wide = __builtin_cpu_supports("avx2");
+#endif
+    }
+    
+    // Take back the tickets reserve added to the first count dates
+    void undoReserve(const int * dates, int count, int tickets)
+    {
+        for (int i = 0;i < count;i ++)
+        {
+            records[dates[i] - 1].reserved -= tickets;
+        }
+    }
+    
+    // Reserve on dates from start on, one at a time, undoing only its own
+    // adds when one falls short
+    bool reserveFrom(const int * dates, int start, int count, int tickets)
+    {
+        for (int i = start;i < count;i ++)
+        {
+            InventoryRecord * record = find(dates[i]);
+            if (record == NULL || record->available() < tickets)
+            {
+                undoReserve(dates + start, i - start, tickets);
+                return false;
+            }
+            record->reserved += tickets;
+        }
+        return true;
+    }
+    
+#ifdef HAVE_X86_SIMD
+    // Eight dates per step: check they exist, add the tickets, then gather
+    // the new availability and make sure none went negative. Checking after
+    // the add also catches a date named twice in one step.
+    __attribute__((target("avx2")))
+    bool reserveWide(const int * dates, int count, int tickets)
+    {
+        const int * fields = (const int *)records;
+        __m256i one = _mm256_set1_epi32(1);
+        __m256i last = _mm256_set1_epi32((int) this->count);
+        
+        int i = 0;
+        for (;i + 8 <= count;i += 8)
+        {
+            __m256i date = _mm256_loadu_si256((const __m256i *)(dates + i));
+            __m256i missing = _mm256_or_si256(_mm256_cmpgt_epi32(one, date), _mm256_cmpgt_epi32(date, last));
+            if (!_mm256_testz_si256(missing, missing))
+            {
+                undoReserve(dates, i, tickets);
+                return false;
+            }
+            
+            // There is no scatter, so the adds go one record at a time
+            for (int j = i;j < i + 8;j ++)
+            {
+                records[dates[j] - 1].reserved += tickets;
+            }
+            
+            // Each record is four ints, capacity first after the id
+            __m256i offset = _mm256_slli_epi32(_mm256_sub_epi32(date, one), 2);
+            __m256i capacity = _mm256_i32gather_epi32(fields + 1, offset, 4);
+            __m256i reserved = _mm256_i32gather_epi32(fields + 2, offset, 4);
+            __m256i sold = _mm256_i32gather_epi32(fields + 3, offset, 4);
+            __m256i available = _mm256_sub_epi32(_mm256_sub_epi32(capacity, reserved), sold);
+            
+            __m256i overbooked = _mm256_cmpgt_epi32(_mm256_setzero_si256(), available);
+            if (!_mm256_testz_si256(overbooked, overbooked))
+            {
+                undoReserve(dates, i + 8, tickets);
+                return false;
+            }
+        }
+        
+        if (!reserveFrom(dates, i, count, tickets))
+        {
+            undoReserve(dates, i, tickets);
+            return false;
+        }
+        return true;
+    }
+#endif
+    
+    bool createFile(string filename, vector<InventoryRecord> & initial)
+    {
+        string tempName = filename + ".tmp";
+        int file = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file == -1)
+        {
+            return false;
+        }
+        
+        InventoryFileHeader header;
+        header.magic = INVENTORY_MAGIC;
+        header.version = INVENTORY_VERSION;
+        header.count = (uint32_t) initial.size();
+        header.reserved = 0;
+        
+        size_t length = initial.size() * sizeof(InventoryRecord);
+        bool written = (write(file, &header, sizeof(header)) == sizeof(header));
+        written = written && (write(file, initial.data(), length) == (ssize_t) length);
+        written = written && (fsync(file) == 0);
+        ::close(file);
+        
+        return written && rename(tempName.c_str(), filename.c_str()) == 0;
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    // Keep the inventory in memory
+    void load(vector<InventoryRecord> & initial)
+    {
+        heapRecords = initial;
+        records = heapRecords.data();
+        count = heapRecords.size();
+        mapped = false;
+        detectWide();
+    }
+    
+    // Map the inventory file, first writing it from initial if rebuild is set
+    // or there is no file yet
+    bool map(string filename, vector<InventoryRecord> & initial, bool rebuild)
+    {
+        if ((rebuild || access(filename.c_str(), F_OK) != 0) && !createFile(filename, initial))
+        {
+            cout << "Error - Could not write " << filename << endl;
+            return false;
+        }
+        
+        fd = open(filename.c_str(), O_RDWR);
+        if (fd == -1)
+        {
+            cout << "Error - Could not open " << filename << endl;
+            return false;
+        }
+        
+        off_t size = lseek(fd, 0, SEEK_END);
+        InventoryFileHeader header;
+        if (size < (off_t) sizeof(header) || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            header.magic != INVENTORY_MAGIC || header.version != INVENTORY_VERSION ||
+            size < (off_t)(sizeof(header) + header.count * sizeof(InventoryRecord)))
+        {
+            cout << "Error - " << filename << " is not an inventory file" << endl;
+            ::close(fd);
+            return false;
+        }
+        
+        mappingLength = sizeof(header) + header.count * sizeof(InventoryRecord);
+        mapping = mmap(NULL, mappingLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            cout << "Error - Could not map " << filename << " " << errno << endl;
+            ::close(fd);
+            return false;
+        }
+        
+        records = (InventoryRecord *)((char *)mapping + sizeof(header));
+        count = header.count;
+        mapped = true;
+        detectWide();
+        
+        return true;
+    }
+    
+    bool isMapped()
+    {
+        return mapped;
+    }
+    
+    // Overwrite every record with a snapshot of the same dates. A mapped
+    // file keeps its mapping and takes the snapshot in place.
+    bool restore(vector<InventoryRecord> & snapshot)
+    {
+        if (!mapped)
+        {
+            load(snapshot);
+            return true;
+        }
+        
+        if (snapshot.size() != count)
+        {
+            return false;
+        }
+        memcpy(records, snapshot.data(), count * sizeof(InventoryRecord));
+        return true;
+    }
+    
+    size_t size()
+    {
+        return count;
+    }
+    
+    InventoryRecord * data()
+    {
+        return records;
+    }
+    
+    // Dates are numbered from 1 in the order of the config file
+    InventoryRecord * find(int date)
+    {
+        if (date < 1 || date > count)
+        {
+            return NULL;
+        }
+        return &records[date - 1];
+    }
+    
+    // Reserve tickets on every date or, if any is missing or short, on none
+    bool reserve(DateList & dates, int tickets)
+    {
+#ifdef HAVE_X86_SIMD
+        if (wide)
+        {
+            return reserveWide(dates.begin(), dates.size(), tickets);
+        }
+#endif
+        return reserveFrom(dates.begin(), 0, dates.size(), tickets);
+    }
+    
+    // Write dirty pages of a mapped inventory back to its file
+    void sync()
+    {
+        if (mapped)
+        {
+            msync(mapping, mappingLength, MS_SYNC);
+        }
+    }
+    
+    void close()
+    {
+        if (mapped)
+        {
+            munmap(mapping, mappingLength);
+            ::close(fd);
+            mapping = NULL;
+            mapped = false;
+        }
+        heapRecords.clear();
+        records = NULL;
+        count = 0;
+    }
+};
+
+class WriteAheadLog
+{
+private:
+    
+    // ** Class Parameters **
+    
+    string filename;
+    string oldFilename;
+    int fd;
+    
+    pthread_t flushThread;
+    pthread_mutex_t lock;
+    pthread_cond_t pendingSignal;
+    pthread_cond_t durableSignal;
+    
+    // Records appended since the last flush. Each record gets the next
+    // sequence number, and everything up to durableLsn is on disk.
+    string pending;
+    uint64_t appendedLsn = 0;
+    uint64_t durableLsn = 0;
+    
+    // A requested rotation moves the log to oldFilename after the first
+    // rotateOffset bytes of pending are written
+    bool rotating = false;
+    size_t rotateOffset = 0;
+    
+    // Microseconds a flush waits for more records to join it
+    int groupCommitWindow;
+    bool running;
+    
+    void (*durableCallback)(void *, uint64_t) = NULL;
+    void * callbackContext = NULL;
+    
+    LogMetrics * metrics = NULL;
+    
+    // ** Private Functions **
+    
+    static uint32_t recordChecksum(WalRecord record, const char * payload)
+    {
+        record.checksum = 0;
+        uint32_t hash = checksum((const char *)&record, sizeof(record), 2166136261u);
+        return checksum(payload, record.length, hash);
+    }
+    
+    void openFile(bool truncate)
+    {
+        fd = open(filename.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+        if (fd == -1)
+        {
+            cout << "Error - Could not open " << filename << endl;
+            exit(1);
+        }
+    }
+    
+    // False if the log could not be written
+    bool writeAll(const char * data, size_t length)
+    {
+        size_t written = 0;
+        while (written < length)
+        {
+            ssize_t n = write(fd, data + written, length - written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            written += n;
+        }
+        
+        return true;
+    }
+    
+    // Read every intact record of one log file, optionally cutting off a torn tail
+    void readFile(string path, vector<WalEntry> & entries, bool repair)
+    {
+        int file = open(path.c_str(), O_RDWR);
+        if (file == -1)
+        {
+            return;
+        }
+        
+        off_t size = lseek(file, 0, SEEK_END);
+        string data(size, '\0');
+        if (size > 0 && pread(file, &data[0], size, 0) != size)
+        {
+            cout << "Error - Could not read " << path << endl;
+            exit(1);
+        }
+        
+        size_t offset = 0;
+        while (data.size() - offset >= sizeof(WalRecord))
+        {
+            WalRecord record;
+            memcpy(&record, data.data() + offset, sizeof(record));
+            
+            if (record.length % sizeof(int) != 0 || data.size() - offset - sizeof(WalRecord) < record.length)
+            {
+                break;
+            }
+            
+            const char * payload = data.data() + offset + sizeof(WalRecord);
+            if (recordChecksum(record, payload) != record.checksum)
+            {
+                break;
+            }
+            
+            WalEntry entry;
+            entry.type = WalRecordType(record.type);
+            entry.transactionId = record.transactionId;
+            entry.lsn = record.lsn;
+            entry.payload.resize(record.length / sizeof(int));
+            memcpy(entry.payload.data(), payload, record.length);
+            entries.push_back(entry);
+            
+            offset += sizeof(WalRecord) + record.length;
+        }
+        
+        if (offset != data.size() && repair)
+        {
+            cout << "Discarding " << (data.size() - offset) << " bytes of torn log" << endl;
+            ftruncate(file, offset);
+        }
+        ::close(file);
+    }
+    
+    // Function to start the log flush thread
+    static void * flushThreadCaller(void * context)
+    {
+        return ((WriteAheadLog *)context)->flushRecords(NULL);
+    }
+    
+    // Threaded function that writes and syncs everything appended since the last
+    // flush, so one fdatasync covers every record that arrived in the meantime
+    void * flushRecords(void *)
+    {
+        pthread_mutex_lock(&lock);
+        while (running || !pending.empty())
+        {
+            if (pending.empty() && !rotating)
+            {
+                pthread_cond_wait(&pendingSignal, &lock);
+                continue;
+            }
+            
+            if (groupCommitWindow > 0 && running && !rotating)
+            {
+                pthread_mutex_unlock(&lock);
+                usleep(groupCommitWindow);
+                pthread_mutex_lock(&lock);
+                
+                if (pending.empty() && !rotating)
+                {
+                    // Discarded by close while waiting, none of it is durable
+                    continue;
+                }
+            }
+            
+            string batch;
+            swap(batch, pending);
+            uint64_t lsn = appendedLsn;
+            bool rotate = rotating;
+            size_t split = (rotate ? rotateOffset : batch.size());
+            pthread_mutex_unlock(&lock);
+            
+            uint64_t flushStart = monotonicTime();
+            bool written = writeAll(batch.data(), split);
+            if (rotate)
+            {
+                // Everything before the split belongs to the old log, which
+                // is only replaced once it is synced and renamed
+                written = written && (fdatasync(fd) == 0);
+                written = written && (rename(filename.c_str(), oldFilename.c_str()) == 0);
+                if (written)
+                {
+                    ::close(fd);
+                    openFile(true);
+                }
+            }
+            written = written && writeAll(batch.data() + split, batch.size() - split);
+            written = written && (fdatasync(fd) == 0);
+            
+            if (!written)
+            {
+                // Votes and acks wait on these records, so none may go out
+                cout << "Error - Could not write " << filename << " " << errno << endl;
+                exit(1);
+            }
+            
+            pthread_mutex_lock(&lock);
+            if (metrics != NULL)
+            {
+                metrics->flushTime.record((monotonicTime() - flushStart) / 1000);
+                metrics->flushRecords.record(lsn - durableLsn);
+            }
+            durableLsn = lsn;
+            if (rotate)
+            {
+                rotating = false;
+            }
+            pthread_cond_broadcast(&durableSignal);
+            pthread_mutex_unlock(&lock);
+            
+            if (durableCallback != NULL)
+            {
+                durableCallback(callbackContext, lsn);
+            }
+            
+            pthread_mutex_lock(&lock);
+        }
+        pthread_mutex_unlock(&lock);
+        
+        pthread_exit(NULL);
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    WriteAheadLog(string logFilename, bool truncate, int window)
+    {
+        filename = logFilename;
+        oldFilename = logFilename + ".old";
+        groupCommitWindow = window;
+        running = true;
+        
+        if (truncate)
+        {
+            unlink(oldFilename.c_str());
+        }
+        openFile(truncate);
+        
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&pendingSignal, NULL);
+        pthread_cond_init(&durableSignal, NULL);
+        
+        if (int s = pthread_create(&flushThread, NULL, &WriteAheadLog::flushThreadCaller, this))
+        {
+            cout << "Error creating log flush thread. Code - " << s << endl;
+            exit(1);
+        }
+    }
+    
+    // Called from the flush thread with the highest durable sequence number
+    void setDurableCallback(void (*callback)(void *, uint64_t), void * context)
+    {
+        callbackContext = context;
+        durableCallback = callback;
+    }
+    
+    // Record flush times in metrics. Set before anything is appended.
+    void setMetrics(LogMetrics * logMetrics)
+    {
+        pthread_mutex_lock(&lock);
+        metrics = logMetrics;
+        pthread_mutex_unlock(&lock);
+    }
+    
+    // Read back every intact record, oldest first, and cut off a torn tail.
+    // Only valid before anything new is appended.
+    vector<WalEntry> recover()
+    {
+        vector<WalEntry> entries;
+        
+        readFile(oldFilename, entries, false);
+        readFile(filename, entries, true);
+        lseek(fd, 0, SEEK_END);
+        
+        // Keep numbering after the last record so replay can tell old from new
+        for (int i = 0;i < entries.size();i ++)
+        {
+            appendedLsn = max(appendedLsn, entries[i].lsn);
+        }
+        durableLsn = appendedLsn;
+        
+        return entries;
+    }
+    
+    // Continue numbering after a checkpoint that is newer than the log
+    void skipTo(uint64_t lsn)
+    {
+        pthread_mutex_lock(&lock);
+        appendedLsn = max(appendedLsn, lsn);
+        durableLsn = max(durableLsn, lsn);
+        pthread_mutex_unlock(&lock);
+    }
+    
+    // Queue a record for the next flush and return its sequence number
+    uint64_t append(WalRecordType type, uint64_t transactionId, const int * payload, int payloadInts)
+    {
+        WalRecord record;
+        record.type = type;
+        record.length = payloadInts * sizeof(int);
+        record.transactionId = transactionId;
+        record.reserved = 0;
+        
+        pthread_mutex_lock(&lock);
+        record.lsn = ++ appendedLsn;
+        record.checksum = recordChecksum(record, (const char *)payload);
+        pending.append((const char *)&record, sizeof(record));
+        pending.append((const char *)payload, record.length);
+        pthread_cond_signal(&pendingSignal);
+        pthread_mutex_unlock(&lock);
+        
+        return record.lsn;
+    }
+    
+    uint64_t getAppendedLsn()
+    {
+        pthread_mutex_lock(&lock);
+        uint64_t lsn = appendedLsn;
+        pthread_mutex_unlock(&lock);
+        return lsn;
+    }
+    
+    uint64_t getDurableLsn()
+    {
+        pthread_mutex_lock(&lock);
+        uint64_t lsn = durableLsn;
+        pthread_mutex_unlock(&lock);
+        return lsn;
+    }
+    
+    // Start a new log file. Records appended so far stay in the old file,
+    // later ones go to the new one. Returns the last record in the old file.
+    uint64_t rotate()
+    {
+        pthread_mutex_lock(&lock);
+        rotating = true;
+        rotateOffset = pending.size();
+        uint64_t lsn = appendedLsn;
+        pthread_cond_signal(&pendingSignal);
+        pthread_mutex_unlock(&lock);
+        
+        return lsn;
+    }
+    
+    // Wait for a rotation to finish, then drop the old file. Only call this
+    // once a checkpoint covers every record in it.
+    void removeOldFile()
+    {
+        pthread_mutex_lock(&lock);
+        while (rotating)
+        {
+            pthread_cond_wait(&durableSignal, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+        
+        unlink(oldFilename.c_str());
+    }
+    
+    // Drop every record, for when a checkpoint covers the whole log and
+    // nothing has been appended since recovery
+    void discardAll()
+    {
+        pthread_mutex_lock(&lock);
+        unlink(oldFilename.c_str());
+        ftruncate(fd, 0);
+        lseek(fd, 0, SEEK_SET);
+        pthread_mutex_unlock(&lock);
+    }
+    
+    // Stop the flush thread, writing out pending records unless the
+    // process is simulating a crash
+    void close(bool flush)
+    {
+        pthread_mutex_lock(&lock);
+        if (!flush)
+        {
+            pending.clear();
+            rotating = false;
+        }
+        running = false;
+        pthread_cond_signal(&pendingSignal);
+        pthread_mutex_unlock(&lock);
+        
+        pthread_join(flushThread, NULL);
+        ::close(fd);
+    }
+};
+
+class ShardWorker
+{
+private:
+    
+    // ** Class Parameters **
+    
+    pthread_t workerThread;
+    pthread_mutex_t lock;
+    pthread_cond_t taskSignal;
+    
+    deque<ShardTask> tasks;
+    bool running;
+    
+    void (*taskHandler)(void *, ShardTask &);
+    void * handlerContext;
+    
+    // ** Private Functions **
+    
+    // Function to start the worker thread
+    static void * workerThreadCaller(void * context)
+    {
+        return ((ShardWorker *)context)->runTasks(NULL);
+    }
+    
+    // Threaded function that runs this shard's tasks in arrival order
+    void * runTasks(void *)
+    {
+        pthread_mutex_lock(&lock);
+        while (running)
+        {
+            if (tasks.empty())
+            {
+                pthread_cond_wait(&taskSignal, &lock);
+                continue;
+            }
+            
+            ShardTask task = tasks.front();
+            tasks.pop_front();
+            pthread_mutex_unlock(&lock);
+            
+            taskHandler(handlerContext, task);
+            
+            pthread_mutex_lock(&lock);
+        }
+        pthread_mutex_unlock(&lock);
+        
+        pthread_exit(NULL);
+    }
+    
+public:
+    
+    // ** Public Functions **
+    
+    ShardWorker(void (*handler)(void *, ShardTask &), void * context)
+    {
+        taskHandler = handler;
+        handlerContext = context;
+        running = true;
+        
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&taskSignal, NULL);
+        
+        if (int s = pthread_create(&workerThread, NULL, &ShardWorker::workerThreadCaller, this))
+        {
+            cout << "Error creating shard thread. Code - " << s << endl;
+            exit(1);
+        }
+    }
+    
+    void push(ShardTask & task)
+    {
+        pthread_mutex_lock(&lock);
+        tasks.push_back(task);
+        pthread_cond_signal(&taskSignal);
+        pthread_mutex_unlock(&lock);
+    }
+    
+    // Stop once the task in hand is done, dropping any still queued
+    void stop()
+    {
+        pthread_mutex_lock(&lock);
+        running = false;
+        tasks.clear();
+        pthread_cond_signal(&taskSignal);
+        pthread_mutex_unlock(&lock);
+        
+        pthread_join(workerThread, NULL);
+    }
+};
+
+class Participant
+{
+private:
+    
+    // ** Class Parameters **
+    
+    string configFile;
+    string myAddress;
+    
+    InventoryStore bookingData;
+    
+    // Dates from the config file, and where a mapped inventory lives
+    vector<InventoryRecord> initialInventory;
+    bool mappedStorage = false;
+    string inventoryName;
+    
+    pthread_t processThread;
+    
+    CommunicationSubstrate * comm;
+    
+    // Prepared transactions waiting for a decision, by request id
+    map<int, Response> commitStorage;
+    
+    // Outcomes of requests decided in one phase, so a resent one is
+    // answered the same way instead of decided again, and those with a
+    // known record ordered by it to forget them below the low-water mark
+    map<int, OnePhaseOutcome> onePhaseOutcomes;
+    set<pair<int, int> > onePhaseByRecord;
+    
+    ofstream outputFile;
+    ofstream logfile;
+    
+    string outputName;
+    
+    WriteAheadLog * wal;
+    string walName;
+    int groupCommitWindow = 0;
+    
+    // Dates are split across shards by date, each worked by its own thread.
+    // A shard count of 0 means one per core.
+    vector<ShardWorker *> shards;
+    int shardCount = 0;
+    
+    // Jobs handed to the shards and not completed yet, and the requests
+    // whose decision is being applied
+    set<ShardJob *> activeJobs;
+    set<int> resolving;
+    pthread_cond_t jobsDone;
+    bool checkpointWaiting = false;
+    
+    // Held while dispatching or completing a job, and by the checkpointer
+    // while it copies the state once every job is done
+    pthread_mutex_t stateLock;
+    
+    // Milliseconds a prepared request waits for its decision before the
+    // coordinator is asked about it. Guarded by stateLock.
+    TimerWheel<DecisionTimer> decisionTimers;
+    uint64_t timerSequence = 0;
+    int decisionTimeout = 10000;
+    
+    pthread_t checkpointThread;
+    pthread_mutex_t checkpointLock;
+    pthread_cond_t checkpointSignal;
+    string checkpointName;
+    int checkpointInterval = 5000;
+    bool checkpointRunning = false;
+    uint64_t checkpointLsn = 0;
+    int lastCommittedId = 0;
+    
+    // Votes and acks held back until the records they depend on are durable
+    deque<PendingReply> pendingReplies;
+    pthread_mutex_t replyLock;
+    
+    pthread_t statsThread;
+    ParticipantMetrics metrics;
+    
+    // Prometheus text is served on this loopback port or Unix socket, if set
+    int metricsPort = 0;
+    string metricsSocket = "";
+    MetricsServer * metricsServer = NULL;
+    
+    // ** Private Functions **
+    
+    // Read lines from a given file
+    vector<string> readFile(string filename)
+    {
+        ifstream readFile (filename);
+        string line;
+        vector<string> lines;
+        if (readFile.is_open())
+        {
+            while (getline(readFile, line))
+            {
+                if (!line.empty() && line[line.length() - 1] == '\r')
+                {
+                    line.erase(line.length() - 1, 1);
+                }
+                lines.push_back(line);
+            }
+            readFile.close();
+        }
+        else
+        {
+            cout << "Error - Could not open " << filename << endl;
+            exit(1);
+        }
+        return lines;
+    }
+    
+    // Read parameters from config file
+    void readConfigFile()
+    {
+        vector<string> lines = readFile(configFile);
+        
+        myAddress = split(lines[0], ' ')[0];
+        
+        // File names default to ones built from the node name
+        string name = "participant-" + split(myAddress, ':')[1];
+        outputName = "";
+        walName = "";
+        checkpointName = "";
+        inventoryName = "";
+        initialInventory.clear();
+        
+        for (int i = 1;i < lines.size();i ++)
+        {
+            vector<string> values = split(lines[i], ' ');
+            if (values.size() < 2)
+            {
+                continue;
+            }
+            
+            // Inventory lines are "date tickets", anything else is a "name value" setting
+            if (isdigit(values[0][0]))
+            {
+                InventoryRecord record;
+                record.resourceId = stoi(values[0]);
+                record.capacity = stoi(values[1]);
+                record.reserved = 0;
+                record.sold = 0;
+                initialInventory.push_back(record);
+            }
+            else if (values[0] == "name")
+            {
+                name = values[1];
+            }
+            else if (values[0] == "shards")
+            {
+                shardCount = max(0, stoi(values[1]));
+            }
+            else if (values[0] == "storage")
+            {
+                mappedStorage = (values[1] == "mmap");
+            }
+            else if (values[0] == "inventory_file")
+            {
+                inventoryName = values[1];
+            }
+            else if (values[0] == "wal")
+            {
+                walName = values[1];
+            }
+            else if (values[0] == "group_commit")
+            {
+                groupCommitWindow = max(0, stoi(values[1]));
+            }
+            else if (values[0] == "decision_timeout")
+            {
+                decisionTimeout = max(1, stoi(values[1]));
+            }
+            else if (values[0] == "checkpoint")
+            {
+                checkpointInterval = max(0, stoi(values[1]));
+            }
+            else if (values[0] == "checkpoint_file")
+            {
+                checkpointName = values[1];
+            }
+            else if (values[0] == "metrics_port")
+            {
+                metricsPort = max(0, stoi(values[1]));
+            }
+            else if (values[0] == "metrics_socket")
+            {
+                metricsSocket = values[1];
+            }
+        }
+        
+        outputName = "storage-" + name + ".txt";
+        walName = (walName.empty() ? "wal-" + name + ".log" : walName);
+        checkpointName = (checkpointName.empty() ? "checkpoint-" + name + ".bin" : checkpointName);
+        inventoryName = (inventoryName.empty() ? "inventory-" + name + ".dat" : inventoryName);
+    }
+    
+    // Map the inventory file or load the config dates into memory. A fresh
+    // start rebuilds the mapped file from the config unless it lists no dates.
+    void openInventory()
+    {
+        if (!mappedStorage)
+        {
+            bookingData.load(initialInventory);
+            return;
+        }
+        
+        bool rebuild = (system_status != RECOVERY && !initialInventory.empty());
+        if (!bookingData.map(inventoryName, initialInventory, rebuild))
+        {
+            exit(1);
+        }
+        cout << "Mapped " << bookingData.size() << " dates from " << inventoryName << endl;
+    }
+    
+    void restoreInventory(vector<InventoryRecord> & snapshot)
+    {
+        if (!bookingData.restore(snapshot))
+        {
+            cout << "Error - " << inventoryName << " does not hold the " << snapshot.size() << " dates being restored" << endl;
+            exit(1);
+        }
+    }
+    
+    void outputBookingData()
+    {
+        outputFile.open (outputName, ios::trunc);
+        for (int i = 0;i < bookingData.size();i ++)
+        {
+            InventoryRecord & record = bookingData.data()[i];
+            outputFile << record.resourceId << " " << record.available() << "\n";
+        }
+        outputFile.close();
+    }
+    
+    // Replaying after-images is idempotent, so it is safe even when a mapped
+    // inventory already holds some of the changes. A shard record is
+    // [tickets, count, (date, reserved, sold)...].
+    void applyImages(vector<int> & payload)
+    {
+        for (int i = 0;payload.size() >= 2 && i < payload[1] && 5 + i * 3 <= payload.size();i ++)
+        {
+            InventoryRecord * record = bookingData.find(payload[2 + i * 3]);
+            if (record != NULL)
+            {
+                record->reserved = payload[3 + i * 3];
+                record->sold = payload[4 + i * 3];
+            }
+        }
+    }
+    
+    // Log the after-images of dates a shard just changed. Shards log the
+    // dates they own as they change them, so the log holds every date's
+    // changes in the order they were made.
+    void logDates(WalRecordType type, int requestId, int tickets, DateList & dates)
+    {
+        vector<int> payload;
+        payload.push_back(tickets);
+        payload.push_back(0);
+        
+        for (int i = 0;i < dates.size();i ++)
+        {
+            InventoryRecord * record = bookingData.find(dates[i]);
+            if (record == NULL)
+            {
+                continue;
+            }
+            
+            payload.push_back(dates[i]);
+            payload.push_back(record->reserved);
+            payload.push_back(record->sold);
+            payload[1] ++;
+        }
+        
+        if (payload[1] > 0)
+        {
+            wal->append(type, requestId, payload.data(), (int) payload.size());
+        }
+    }
+    
+    // Sell or release reserved tickets on some dates and log them
+    void changeDates(WalRecordType type, int requestId, int tickets, DateList & dates)
+    {
+        for (int i = 0;i < dates.size();i ++)
+        {
+            InventoryRecord * record = bookingData.find(dates[i]);
+            if (record == NULL)
+            {
+                continue;
+            }
+            
+            record->reserved -= tickets;
+            if (type == WAL_SELL)
+            {
+                record->sold += tickets;
+            }
+        }
+        
+        logDates(type, requestId, tickets, dates);
+    }
+    
+    // Write a snapshot of the given state next to the old one, then swap it
+    // in. False if it could not be written.
+    bool writeCheckpoint(uint64_t lsn, int lastId, vector<InventoryRecord> & inventory, map<int, Response> & prepared, map<int, OnePhaseOutcome> & onePhase)
+    {
+        vector<int> body((int *) inventory.data(), (int *)(inventory.data() + inventory.size()));
+        for (map<int, Response>::iterator it = prepared.begin();it != prepared.end();it ++)
+        {
+            Response & req = it->second;
+            body.push_back(req.requestId);
+            body.push_back(req.tickets);
+            body.push_back((int) req.dates.size());
+            body.insert(body.end(), req.dates.begin(), req.dates.end());
+        }
+        for (map<int, OnePhaseOutcome>::iterator it = onePhase.begin();it != onePhase.end();it ++)
+        {
+            body.push_back(it->first);
+            body.push_back(it->second.record);
+            body.push_back(it->second.vote);
+        }
+        
+        CheckpointHeader header;
+        header.magic = CHECKPOINT_MAGIC;
+        header.version = CHECKPOINT_VERSION;
+        header.lsn = lsn;
+        header.lastTransactionId = lastId;
+        header.inventoryCount = (uint32_t) inventory.size();
+        header.preparedCount = (uint32_t) prepared.size();
+        header.onePhaseCount = (uint32_t) onePhase.size();
+        header.reserved = 0;
+        header.length = (uint32_t)(body.size() * sizeof(int));
+        header.checksum = checksum((const char *)body.data(), header.length, 2166136261u);
+        
+        string tempName = checkpointName + ".tmp";
+        int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+        {
+            cout << "Error - Could not write " << tempName << endl;
+            return false;
+        }
+        
+        bool written = (write(fd, &header, sizeof(header)) == sizeof(header));
+        written = written && (write(fd, body.data(), header.length) == header.length);
+        written = written && (fsync(fd) == 0);
+        close(fd);
+        
+        if (!written || rename(tempName.c_str(), checkpointName.c_str()) != 0)
+        {
+            cout << "Error - Could not write " << tempName << endl;
+            unlink(tempName.c_str());
+            return false;
+        }
+        
+        // Make the rename durable before any log it replaces is removed
+        int dir = open(".", O_RDONLY);
+        fsync(dir);
+        close(dir);
+        
+        checkpointLsn = lsn;
+        return true;
+    }
+    
+    // Load the newest snapshot, if there is a valid one. Returns the last
+    // log record it covers.
+    uint64_t loadCheckpoint()
+    {
+        // A mapped file may hold changes whose log records were lost, so
+        // it never counts as a snapshot. Without a checkpoint the log is
+        // replayed onto the config dates.
+        if (bookingData.isMapped() && !initialInventory.empty())
+        {
+            restoreInventory(initialInventory);
+        }
+        
+        ifstream file (checkpointName, ios::binary);
+        if (!file.is_open())
+        {
+            return 0;
+        }
+        
+        CheckpointHeader header;
+        vector<int> body;
+        if (file.read((char *)&header, sizeof(header)))
+        {
+            body.resize(header.length / sizeof(int));
+            file.read((char *)body.data(), header.length);
+        }
+        
+        size_t inventoryInts = header.inventoryCount * sizeof(InventoryRecord) / sizeof(int);
+        if (!file || header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION ||
+            inventoryInts > body.size() ||
+            checksum((const char *)body.data(), header.length, 2166136261u) != header.checksum)
+        {
+            cout << "Ignoring unreadable checkpoint " << checkpointName << endl;
+            return 0;
+        }
+        
+        vector<InventoryRecord> inventory(header.inventoryCount);
+        memcpy(inventory.data(), body.data(), inventoryInts * sizeof(int));
+        restoreInventory(inventory);
+        
+        size_t pos = inventoryInts;
+        for (int i = 0;i < header.preparedCount && pos + 3 <= body.size();i ++)
+        {
+            Response req;
+            req.isRequest = true;
+            req.requestId = body[pos ++];
+            req.tickets = body[pos ++];
+            size_t dateCount = body[pos ++];
+            dateCount = min(dateCount, body.size() - pos);
+            req.dates.assign(body.begin() + pos, body.begin() + pos + dateCount);
+            pos += dateCount;
+            commitStorage[req.requestId] = req;
+        }
+        
+        for (int i = 0;i < header.onePhaseCount && pos + 3 <= body.size();i ++)
+        {
+            int requestId = body[pos ++];
+            int record = body[pos ++];
+            rememberOnePhase(requestId, record, VoteStatus(body[pos ++]));
+        }
+        
+        lastCommittedId = (int) header.lastTransactionId;
+        checkpointLsn = header.lsn;
+        cout << "Loaded checkpoint at log record " << header.lsn << ", last transaction " << lastCommittedId << endl;
+        
+        return header.lsn;
+    }
+    
+    // Snapshot the current state and drop the log records it covers
+    void checkpoint()
+    {
+        pthread_mutex_lock(&stateLock);
+        
+        // Hold back new messages until the shards are idle, so the copy
+        // has no half-applied jobs in it
+        checkpointWaiting = true;
+        waitForJobs();
+        
+        uint64_t lsn = wal->rotate();
+        vector<InventoryRecord> inventory(bookingData.data(), bookingData.data() + bookingData.size());
+        map<int, Response> prepared(commitStorage);
+        map<int, OnePhaseOutcome> onePhase(onePhaseOutcomes);
+        int lastId = lastCommittedId;
+        checkpointWaiting = false;
+        pthread_cond_broadcast(&jobsDone);
+        pthread_mutex_unlock(&stateLock);
+        
+        writeCheckpoint(lsn, lastId, inventory, prepared, onePhase);
+        if (checkpointLsn == lsn)
+        {
+            wal->removeOldFile();
+        }
+    }
+    
+    // Function to start the checkpoint thread
+    static void * checkpointThreadCaller(void * context)
+    {
+        return ((Participant *)context)->runCheckpoints(NULL);
+    }
+    
+    // Threaded function that checkpoints whenever the log has grown
+    void * runCheckpoints(void *)
+    {
+        pthread_mutex_lock(&checkpointLock);
+        while (checkpointRunning)
+        {
+            timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += checkpointInterval / 1000;
+            deadline.tv_nsec += (checkpointInterval % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec ++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&checkpointSignal, &checkpointLock, &deadline);
+            
+            if (checkpointRunning && wal->getAppendedLsn() > checkpointLsn)
+            {
+                pthread_mutex_unlock(&checkpointLock);
+                checkpoint();
+                pthread_mutex_lock(&checkpointLock);
+            }
+        }
+        pthread_mutex_unlock(&checkpointLock);
+        
+        pthread_exit(NULL);
+    }
+    
+    void startCheckpoints()
+    {
+        if (checkpointInterval == 0)
+        {
+            return;
+        }
+        
+        checkpointRunning = true;
+        if (int s = pthread_create(&checkpointThread, NULL, &Participant::checkpointThreadCaller, this))
+        {
+            cout << "Error creating checkpoint thread. Code - " << s << endl;
+            exit(1);
+        }
+    }
+    
+    void stopCheckpoints()
+    {
+        if (!checkpointRunning)
+        {
+            return;
+        }
+        
+        pthread_mutex_lock(&checkpointLock);
+        checkpointRunning = false;
+        pthread_cond_signal(&checkpointSignal);
+        pthread_mutex_unlock(&checkpointLock);
+        
+        pthread_join(checkpointThread, NULL);
+    }
+    
+    // Log a yes vote so the prepared request survives a failure
+    uint64_t logPrepare(Response & req)
+    {
+        vector<int> payload;
+        payload.push_back(req.tickets);
+        payload.push_back((int) req.dates.size());
+        payload.insert(payload.end(), req.dates.begin(), req.dates.end());
+        
+        return wal->append(WAL_PREPARE, req.requestId, payload.data(), (int) payload.size());
+    }
+    
+    void rememberOnePhase(int requestId, int record, VoteStatus vote)
+    {
+        forgetOnePhase(requestId);
+        
+        OnePhaseOutcome outcome;
+        outcome.record = record;
+        outcome.vote = vote;
+        onePhaseOutcomes[requestId] = outcome;
+        if (record >= 0)
+        {
+            onePhaseByRecord.insert(make_pair(record, requestId));
+        }
+    }
+    
+    void forgetOnePhase(int requestId)
+    {
+        map<int, OnePhaseOutcome>::iterator it = onePhaseOutcomes.find(requestId);
+        if (it != onePhaseOutcomes.end())
+        {
+            onePhaseByRecord.erase(make_pair(it->second.record, requestId));
+            onePhaseOutcomes.erase(it);
+        }
+    }
+    
+    // Drop the outcomes of records the coordinator has finished with
+    void forgetOnePhaseBelow(int lowWater)
+    {
+        while (!onePhaseByRecord.empty() && onePhaseByRecord.begin()->first < lowWater)
+        {
+            onePhaseOutcomes.erase(onePhaseByRecord.begin()->second);
+            onePhaseByRecord.erase(onePhaseByRecord.begin());
+        }
+    }
+    
+    // Log how a one phase request was decided as [vote, record], and keep
+    // it to answer a resend
+    uint64_t logOnePhase(int requestId, int record, VoteStatus vote)
+    {
+        rememberOnePhase(requestId, record, vote);
+        
+        int payload[2] = {vote, record};
+        return wal->append(WAL_ONE_PHASE, requestId, payload, 2);
+    }
+    
+    // Settle a transaction whose shard records outlived the record that
+    // would have settled it. Sold dates mean it was committed and
+    // released ones that it was aborted. Reservations alone are kept only
+    // if the yes vote was logged.
+    void finishReplayed(int requestId, ReplayChanges & change)
+    {
+        map<int, Response>::iterator prepared = commitStorage.find(requestId);
+        int tickets = (prepared != commitStorage.end() ? prepared->second.tickets : change.tickets);
+        set<int> dates(change.reserved);
+        if (prepared != commitStorage.end())
+        {
+            dates.insert(prepared->second.dates.begin(), prepared->second.dates.end());
+        }
+        
+        DateList remaining;
+        if (!change.sold.empty())
+        {
+            set_difference(dates.begin(), dates.end(), change.sold.begin(), change.sold.end(), back_inserter(remaining));
+            changeDates(WAL_SELL, requestId, tickets, remaining);
+            lastCommittedId = requestId;
+            
+            if (prepared != commitStorage.end())
+            {
+                commitStorage.erase(prepared);
+                wal->append(WAL_COMMIT, requestId, NULL, 0);
+            }
+            else
+            {
+                // Its record is learnt from the resend the coordinator
+                // still owes, as it never saw the outcome
+                logOnePhase(requestId, -1, VOTE_YES);
+            }
+            cout << "Finished commit of id " << requestId << endl;
+        }
+        else if (!change.released.empty() || prepared == commitStorage.end())
+        {
+            set_difference(dates.begin(), dates.end(), change.released.begin(), change.released.end(), back_inserter(remaining));
+            changeDates(WAL_RELEASE, requestId, tickets, remaining);
+            
+            if (prepared != commitStorage.end())
+            {
+                commitStorage.erase(prepared);
+            }
+            wal->append(WAL_ABORT, requestId, NULL, 0);
+            cout << "Released reservations of id " << requestId << endl;
+        }
+    }
+    
+    // Rebuild bookingData and the prepared requests from the last
+    // checkpoint and the log records after it
+    void replayLog()
+    {
+        uint64_t startLsn = loadCheckpoint();
+        vector<WalEntry> entries = wal->recover();
+        wal->skipTo(startLsn);
+        
+        map<int, ReplayChanges> changes;
+        
+        int replayed = 0;
+        for (int i = 0;i < entries.size();i ++)
+        {
+            WalEntry & entry = entries[i];
+            int requestId = (int) entry.transactionId;
+            
+            if (entry.lsn <= startLsn)
+            {
+                continue;
+            }
+            replayed ++;
+            
+            if (entry.type == WAL_RESERVE || entry.type == WAL_SELL || entry.type == WAL_RELEASE)
+            {
+                if (entry.payload.size() < 2)
+                {
+                    continue;
+                }
+                applyImages(entry.payload);
+                
+                ReplayChanges & change = changes[requestId];
+                change.tickets = entry.payload[0];
+                set<int> & dates = (entry.type == WAL_RESERVE ? change.reserved : (entry.type == WAL_SELL ? change.sold : change.released));
+                for (int j = 0;j < entry.payload[1] && 5 + j * 3 <= entry.payload.size();j ++)
+                {
+                    dates.insert(entry.payload[2 + j * 3]);
+                }
+            }
+            else if (entry.type == WAL_PREPARE && entry.payload.size() >= 2)
+            {
+                Response req;
+                req.requestId = requestId;
+                req.isRequest = true;
+                req.tickets = entry.payload[0];
+                req.dates.assign(entry.payload.begin() + 2, entry.payload.end());
+                commitStorage[requestId] = req;
+            }
+            else if (entry.type == WAL_COMMIT)
+            {
+                lastCommittedId = requestId;
+                commitStorage.erase(requestId);
+                changes.erase(requestId);
+            }
+            else if (entry.type == WAL_ABORT)
+            {
+                commitStorage.erase(requestId);
+                changes.erase(requestId);
+            }
+            else if (entry.type == WAL_ONE_PHASE)
+            {
+                // Logs before outcomes were kept only logged commits
+                VoteStatus vote = (entry.payload.size() >= 2 ? VoteStatus(entry.payload[0]) : VOTE_YES);
+                int record = (entry.payload.size() >= 2 ? entry.payload[1] : -1);
+                rememberOnePhase(requestId, record, vote);
+                
+                // A no vote's reservations are released after its record,
+                // so anything left of them is finished below
+                if (vote != VOTE_NO)
+                {
+                    lastCommittedId = requestId;
+                    changes.erase(requestId);
+                }
+            }
+        }
+        
+        for (map<int, ReplayChanges>::iterator it = changes.begin();it != changes.end();it ++)
+        {
+            finishReplayed(it->first, it->second);
+        }
+        
+        cout << "Replayed " << replayed << " log records, " << commitStorage.size() << " requests still prepared" << endl;
+        
+        // Fold the replayed tail into a fresh checkpoint so the next
+        // restart starts from here
+        if (replayed > 0)
+        {
+            uint64_t lsn = wal->getAppendedLsn();
+            vector<InventoryRecord> inventory(bookingData.data(), bookingData.data() + bookingData.size());
+            writeCheckpoint(lsn, lastCommittedId, inventory, commitStorage, onePhaseOutcomes);
+            if (checkpointLsn == lsn)
+            {
+                wal->discardAll();
+            }
+        }
+    }
+    
+    void openLog()
+    {
+        bool fresh = (system_status != RECOVERY);
+        if (fresh)
+        {
+            unlink(checkpointName.c_str());
+            checkpointLsn = 0;
+        }
+        
+        wal = new WriteAheadLog(walName, fresh, groupCommitWindow);
+        wal->setMetrics(&metrics.wal);
+        
+        if (fresh && bookingData.isMapped())
+        {
+            // The starting dates replay begins from, as the mapped file
+            // runs ahead of the log
+            vector<InventoryRecord> inventory(bookingData.data(), bookingData.data() + bookingData.size());
+            if (!writeCheckpoint(0, 0, inventory, commitStorage, onePhaseOutcomes))
+            {
+                exit(1);
+            }
+        }
+        else if (!fresh)
+        {
+            replayLog();
+        }
+        
+        wal->setDurableCallback(&Participant::logDurableCaller, this);
+        startCheckpoints();
+    }
+    
+    // Called by the log flush thread
+    static void logDurableCaller(void * context, uint64_t lsn)
+    {
+        ((Participant *)context)->releaseReplies(lsn);
+    }
+    
+    void sendReply(PendingReply & reply)
+    {
+        if (reply.startedAt != 0)
+        {
+            uint64_t elapsed = (monotonicTime() - reply.startedAt) / 1000;
+            (reply.type == MSG_ACK ? metrics.decisionTime : metrics.prepareTime).record(elapsed);
+        }
+        
+        if (reply.type == MSG_VOTE)
+        {
+            comm->sendVote(reply.votes[0], reply.requestIds[0]);
+        }
+        else if (reply.type == MSG_VOTE_BATCH)
+        {
+            comm->sendVotes(reply.requestIds, reply.votes);
+        }
+        else
+        {
+            comm->sendAck(reply.requestIds[0]);
+        }
+    }
+    
+    // Send a reply now if its record is already durable, otherwise once it is
+    void deferReply(PendingReply reply)
+    {
+        pthread_mutex_lock(&replyLock);
+        if (pendingReplies.empty() && reply.lsn <= wal->getDurableLsn())
+        {
+            sendReply(reply);
+        }
+        else
+        {
+            pendingReplies.push_back(reply);
+        }
+        metrics.pendingReplies.store(pendingReplies.size(), memory_order_relaxed);
+        pthread_mutex_unlock(&replyLock);
+    }
+    
+    void releaseReplies(uint64_t lsn)
+    {
+        pthread_mutex_lock(&replyLock);
+        while (!pendingReplies.empty() && pendingReplies.front().lsn <= lsn)
+        {
+            sendReply(pendingReplies.front());
+            pendingReplies.pop_front();
+        }
+        metrics.pendingReplies.store(pendingReplies.size(), memory_order_relaxed);
+        pthread_mutex_unlock(&replyLock);
+    }
+    
+    // Whether a request sells anything, or only reads
+    bool changesInventory(Response & req)
+    {
+        return req.tickets > 0 && !req.dates.empty();
+    }
+    
+    int shardFor(int date)
+    {
+        int shard = date % (int) shards.size();
+        return (shard < 0 ? shard + (int) shards.size() : shard);
+    }
+    
+    void startShards()
+    {
+        int count = shardCount;
+        if (count <= 0)
+        {
+            count = max(1, (int) sysconf(_SC_NPROCESSORS_ONLN));
+        }
+        
+        for (int i = 0;i < count;i ++)
+        {
+            shards.push_back(new ShardWorker(&Participant::shardTaskCaller, this));
+        }
+        cout << "Started " << count << " inventory shards" << endl;
+    }
+    
+    // Stop the workers and drop whatever they had not finished
+    void stopShards()
+    {
+        for (int i = 0;i < shards.size();i ++)
+        {
+            shards[i]->stop();
+            delete shards[i];
         }
-        cout << "Waiting for connection from coordinator..." << endl;
+        shards.clear();
         
-        socklen_t size;
-        messageSocket = accept(coordinatorSocket, (sockaddr *)&coordinatorInfo, &size);
-        if (messageSocket == -1)
+        pthread_mutex_lock(&stateLock);
+        for (set<ShardJob *>::iterator it = activeJobs.begin();it != activeJobs.end();it ++)
         {
-            cout << "Error accepting connection" << endl;
-            exit(1);
+            delete *it;
+        }
+        activeJobs.clear();
+        resolving.clear();
+        pthread_cond_broadcast(&jobsDone);
+        pthread_mutex_unlock(&stateLock);
+    }
+    
+    // Wait until every job handed to the shards has completed. Called with stateLock held.
+    void waitForJobs()
+    {
+        while (!activeJobs.empty())
+        {
+            pthread_cond_wait(&jobsDone, &stateLock);
         }
-        
-        cout << "Coordinator connected." << endl;
     }
     
-    // Function to start thread D
-    static void *messageRecieveThreadCaller(void * context)
+    ShardJob * createJob(ShardJobType type, MessageType replyType)
     {
-        return ((CommunicationSubstrate *)context)->recieveMessages(NULL);
+        ShardJob * job = new ShardJob();
+        job->type = type;
+        job->onePhase = false;
+        job->replyType = replyType;
+        job->replyRequired = true;
+        job->startedAt = monotonicTime();
+        pthread_mutex_init(&job->lock, NULL);
+        return job;
     }
     
-    void recieveDataFromSocket(int socket, int * buffer)
+    // Hand each request's dates to the shards that own them. Called with stateLock held.
+    void dispatchJob(ShardJob * job)
     {
-        size_t bytesRecieved = recv(socket, buffer, 64, 0);
-        if (bytesRecieved > 0)
+        job->reservedDates.resize(job->requests.size());
+        
+        vector<ShardTask> tasks;
+        for (int i = 0;i < job->requests.size();i ++)
         {
-            if (bytesRecieved == sizeof(int))
+            map<int, ShardTask> byShard;
+            Response & req = job->requests[i];
+            for (int j = 0;j < req.dates.size();j ++)
+            {
+                ShardTask & task = byShard[shardFor(req.dates[j])];
+                task.job = job;
+                task.index = i;
+                task.dates.push_back(req.dates[j]);
+            }
+            
+            if (byShard.empty())
             {
-                cout << "Finished packet recieved" << endl;
-                stopSubstrate();
-                exit(0);
+                // Still run it once so the job completes like any other
+                ShardTask & task = byShard[0];
+                task.job = job;
+                task.index = i;
             }
-            Packet packet = Packet::createFromRawData(buffer, socket, (int) bytesRecieved);
-            if (system_status == NORMAL)
+            
+            for (map<int, ShardTask>::iterator it = byShard.begin();it != byShard.end();it ++)
             {
-                inputBuffer.push(packet);
+                tasks.push_back(it->second);
             }
         }
-    }
-    
-    // Threaded function to recieve messages
-    void * recieveMessages(void *)
-    {
-        int * buffer = new int[64];
         
-        while (system_status != FINISHED)
+        job->remaining = (int) tasks.size();
+        activeJobs.insert(job);
+        metrics.shardTasks.fetch_add(tasks.size(), memory_order_relaxed);
+        for (int i = 0;i < tasks.size();i ++)
         {
-            recieveDataFromSocket(messageSocket, buffer);
+            shards[shardFor(tasks[i].dates.empty() ? 0 : tasks[i].dates[0])]->push(tasks[i]);
         }
-        
-        pthread_exit(NULL);
     }
     
-    // Function to start thread C
-    static void *substrateThreadCaller(void * context)
+    // Give back the reservations a request got before another shard turned
+    // it down. Called with stateLock held.
+    void releaseReserved(Response & req, DateList & dates)
     {
-        return ((CommunicationSubstrate *)context)->processBuffers(NULL);
+        ShardJob * job = createJob(JOB_RELEASE, MSG_ACK);
+        job->replyRequired = false;
+        job->requests.push_back(req);
+        job->requests[0].dates = dates;
+        dispatchJob(job);
     }
     
-    // Threaded function to process buffers
-    void * processBuffers(void *)
+    // Called by a shard worker
+    static void shardTaskCaller(void * context, ShardTask & task)
     {
-        while (system_status != FINISHED)
+        ((Participant *)context)->runShardTask(task);
+    }
+    
+    // Reserve, sell or release one request's tickets on the dates this shard owns
+    void runShardTask(ShardTask & task)
+    {
+        ShardJob * job = task.job;
+        Response & req = job->requests[task.index];
+        
+        if (job->type == JOB_PREPARE || job->type == JOB_ONE_PHASE)
         {
-            if (!outputBuffer.empty())
+            // All of this shard's dates or none of them, checked and
+            // reserved in one pass
+            bool available = bookingData.reserve(task.dates, req.tickets);
+            if (available && req.tickets > 0 && !task.dates.empty())
             {
-                Packet p = outputBuffer.front();
-                p.sendPacket();
-                outputBuffer.pop();
+                logDates(WAL_RESERVE, req.requestId, req.tickets, task.dates);
             }
             
-            if (!inputBuffer.empty())
+            pthread_mutex_lock(&job->lock);
+            if (!available)
+            {
+                job->votes[task.index] = VOTE_NO;
+            }
+            else if (req.tickets > 0)
             {
-                Packet p = inputBuffer.front();
-                Response res = Response::createFromPacket(p);
-                responseBuffer.push(res);
-                inputBuffer.pop();
+                DateList & reserved = job->reservedDates[task.index];
+                copy(task.dates.begin(), task.dates.end(), back_inserter(reserved));
             }
+            pthread_mutex_unlock(&job->lock);
+        }
+        else if (job->type == JOB_COMMIT)
+        {
+            changeDates(WAL_SELL, req.requestId, req.tickets, task.dates);
+        }
+        else
+        {
+            changeDates(WAL_RELEASE, req.requestId, req.tickets, task.dates);
         }
         
-        pthread_exit(NULL);
+        pthread_mutex_lock(&job->lock);
+        bool done = (-- job->remaining == 0);
+        pthread_mutex_unlock(&job->lock);
+        metrics.shardTasks.fetch_sub(1, memory_order_relaxed);
+        
+        if (done)
+        {
+            completeJob(job);
+        }
     }
     
-    void startSubstrate()
+    // Log the outcome of a job whose shards have all finished and queue its reply
+    void completeJob(ShardJob * job)
     {
-        cout << "Starting communication substrate..." << endl;
-        
-        if (int s = pthread_create(&bufferThread, NULL, &CommunicationSubstrate::substrateThreadCaller, this))
+        pthread_mutex_lock(&stateLock);
+        if (activeJobs.count(job) == 0)
         {
-            cout << "Error creating buffer thread. Code - " << s << endl;
-            exit(1);
+            // Dropped by a failure
+            pthread_mutex_unlock(&stateLock);
+            return;
         }
         
-        if (int s = pthread_create(&recieveThread, NULL, &CommunicationSubstrate::messageRecieveThreadCaller, this))
+        Response & first = job->requests[0];
+        if (job->type == JOB_ONE_PHASE && job->votes[0] == VOTE_YES && changesInventory(first))
         {
-            cout << "Error creating message thread. Code - " << s << endl;
-            exit(1);
+            // Every shard holds its tickets, now sell them on all of them
+            job->type = JOB_COMMIT;
+            job->onePhase = true;
+            dispatchJob(job);
+            pthread_mutex_unlock(&stateLock);
+            return;
         }
         
-        cout << "Communication substrate started." << endl;
-    }
-    
-public:
-    
-    // ** Public Functions **
-    
-    CommunicationSubstrate(string socketAddress)
-    {
-        coordinatorSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        participantAddress = socketAddress;
-        connectToCoordinator(true);
-        startSubstrate();
-    }
-    
-    Response waitForResponse()
-    {
-        cout << "Waiting for response..." << endl;
-        Response r;
-        
-        time_t startTime;
-        time_t currentTime;
-        time(&startTime);
+        PendingReply reply;
+        reply.lsn = 0;
+        reply.startedAt = job->startedAt;
+        reply.type = job->replyType;
         
-        while (system_status == NORMAL)
+        if (job->type == JOB_PREPARE || job->type == JOB_ONE_PHASE)
         {
-            time(&currentTime);
-            if (currentTime - startTime > 10)
+            for (int i = 0;i < job->requests.size();i ++)
             {
-                cout << "Timeout..." << endl;
-                return Response();
+                Response & req = job->requests[i];
+                VoteStatus vote = job->votes[i];
+                resolving.erase(req.requestId);
+                
+                if (vote == VOTE_NO && !job->reservedDates[i].empty())
+                {
+                    releaseReserved(req, job->reservedDates[i]);
+                }
+                
+                if (vote == VOTE_NO && job->type == JOB_ONE_PHASE)
+                {
+                    // Kept like a commit, so a resend is refused again
+                    reply.lsn = logOnePhase(req.requestId, req.record, VOTE_NO);
+                }
+                else if (vote == VOTE_YES && !changesInventory(req) && job->type == JOB_PREPARE)
+                {
+                    // Nothing to change here, so nothing to hold or log
+                    vote = VOTE_READ_ONLY;
+                }
+                else if (vote == VOTE_YES && job->type == JOB_PREPARE)
+                {
+                    commitStorage[req.requestId] = req;
+                    armDecisionTimer(commitStorage[req.requestId]);
+                    reply.lsn = logPrepare(req);
+                }
+                reply.requestIds.push_back(req.requestId);
+                reply.votes.push_back(vote);
+                
+                if (job->type == JOB_PREPARE)
+                {
+                    atomic<uint64_t> & votes = (vote == VOTE_YES ? metrics.yesVotes : (vote == VOTE_NO ? metrics.noVotes : metrics.readOnlyVotes));
+                    votes.fetch_add(1, memory_order_relaxed);
+                }
+                else
+                {
+                    // A one phase request that sells nothing commits here
+                    (vote == VOTE_NO ? metrics.aborts : metrics.onePhaseCommits).fetch_add(1, memory_order_relaxed);
+                }
             }
+        }
+        else if (job->type == JOB_RELEASE)
+        {
+            // Settles the reservations for replay, nobody waits on it
+            wal->append(WAL_ABORT, first.requestId, NULL, 0);
+        }
+        else
+        {
+            reply.requestIds.push_back(first.requestId);
+            resolving.erase(first.requestId);
             
-            if (!responseBuffer.empty())
+            if (job->type == JOB_COMMIT && job->onePhase)
             {
-                r = responseBuffer.front();
-                responseBuffer.pop();
-                return r;
+                lastCommittedId = first.requestId;
+                metrics.onePhaseCommits.fetch_add(1, memory_order_relaxed);
+                reply.lsn = logOnePhase(first.requestId, first.record, VOTE_YES);
+                reply.votes.push_back(VOTE_YES);
+            }
+            else if (job->type == JOB_COMMIT)
+            {
+                lastCommittedId = first.requestId;
+                commitStorage.erase(first.requestId);
+                metrics.commits.fetch_add(1, memory_order_relaxed);
+                reply.lsn = wal->append(WAL_COMMIT, first.requestId, NULL, 0);
+            }
+            else
+            {
+                commitStorage.erase(first.requestId);
+                metrics.aborts.fetch_add(1, memory_order_relaxed);
+                reply.lsn = wal->append(WAL_ABORT, first.requestId, NULL, 0);
             }
+            
+            cout << "2PC for id " << first.requestId << " complete." << endl;
         }
         
-        return Response();
-    }
-    
-    void sendVote(VoteStatus vote, int requestId)
-    {
-        cout << "Sending " << (vote == VOTE_YES ? "yes vote for " : "no vote for ") << requestId << endl;
+        if (job->replyRequired)
+        {
+            deferReply(reply);
+        }
         
-        Packet votePacket = Packet::createVotePacket(vote, messageSocket, requestId);
-        outputBuffer.push(votePacket);
-    }
-    
-    void sendAck(int requestId)
-    {
-        cout << "Sending acknowledgement for id " << requestId << endl;
+        metrics.prepared.store(commitStorage.size(), memory_order_relaxed);
+        activeJobs.erase(job);
+        pthread_cond_broadcast(&jobsDone);
+        pthread_mutex_unlock(&stateLock);
         
-        Packet ackPacket = Packet::createAckPacket(messageSocket, requestId);
-        outputBuffer.push(ackPacket);
+        pthread_mutex_destroy(&job->lock);
+        delete job;
     }
     
-    void stopSubstrate()
+    // Answer a resent request that was already voted on, once the record
+    // of that vote is durable
+    void resendVotes(MessageType type, vector<int> & requestIds, VoteStatus vote)
     {
-        close(coordinatorSocket);
-        close(messageSocket);
+        PendingReply reply;
+        reply.lsn = wal->getAppendedLsn();
+        reply.startedAt = 0;
+        reply.type = type;
+        reply.requestIds = requestIds;
+        reply.votes.assign(requestIds.size(), vote);
+        deferReply(reply);
     }
     
-    void failSystem()
+    bool processRequest(Response & res)
     {
-        outputBuffer = queue<Packet>();
-        inputBuffer = queue<Packet>();
-        responseBuffer = queue<Response>();
+        cout << "Recieved request id " << res.requestId << endl;
         
-        cout << "Communication Substrate failed." << endl;
-    }
-    
-    void reconnect()
-    {
-        connectToCoordinator(false);
+        if (commitStorage.count(res.requestId))
+        {
+            vector<int> requestIds(1, res.requestId);
+            resendVotes(MSG_VOTE, requestIds, VOTE_YES);
+            return true;
+        }
+        
+        if (resolving.count(res.requestId))
+        {
+            // Already being prepared or decided, the reply is on its way
+            return false;
+        }
+        resolving.insert(res.requestId);
+        
+        ShardJob * job = createJob(JOB_PREPARE, MSG_VOTE);
+        job->requests.push_back(res);
+        job->votes.push_back(VOTE_YES);
+        dispatchJob(job);
+        
+        return true;
     }
-};
-
-class Participant
-{
-private:
-    
-    // ** Class Parameters **
-    
-    string configFile;
-    string myAddress;
-    
-    vector<int> bookingData;
-    
-    pthread_t processThread;
-    
-    CommunicationSubstrate * comm;
-    
-    Response commitStorage;
-    
-    ofstream outputFile;
-    ofstream logfile;
-    
-    string outputName;
-    
-    // ** Private Functions **
     
-    // Read lines from a given file
-    vector<string> readFile(string filename)
+    // Vote on every request of a batch and answer with one vote vector
+    bool processBatchRequest(Response & res)
     {
-        ifstream readFile (filename);
-        string line;
-        vector<string> lines;
-        if (readFile.is_open())
+        if (res.batchSize() <= 0)
         {
-            while (getline(readFile, line))
+            return false;
+        }
+        
+        cout << "Recieved " << res.batchSize() << " requests from id " << res.requestId << endl;
+        
+        ShardJob * job = createJob(JOB_PREPARE, MSG_VOTE_BATCH);
+        vector<int> preparedIds;
+        Response req;
+        for (int i = 0, pos = 1;i < res.batchSize() && res.nextInBatch(pos, req);i ++)
+        {
+            if (commitStorage.count(req.requestId))
             {
-                lines.push_back(line);
+                preparedIds.push_back(req.requestId);
+            }
+            else if (!resolving.count(req.requestId))
+            {
+                resolving.insert(req.requestId);
+                job->requests.push_back(req);
             }
-            readFile.close();
         }
-        else
+        
+        if (!preparedIds.empty())
         {
-            cout << "Error - Could not open " << filename << endl;
-            exit(1);
+            resendVotes(MSG_VOTE_BATCH, preparedIds, VOTE_YES);
         }
-        return lines;
+        
+        if (job->requests.empty())
+        {
+            pthread_mutex_destroy(&job->lock);
+            delete job;
+            return true;
+        }
+        
+        job->votes.assign(job->requests.size(), VOTE_YES);
+        dispatchJob(job);
+        
+        return true;
     }
     
-    // Read parameters from config file
-    void readConfigFile()
+    // Decide a request this participant is the only one involved in, and
+    // answer with the outcome once its commit is logged
+    bool processOnePhaseRequest(Response & res)
     {
-        vector<string> lines;
-        if (system_status == RECOVERY)
+        cout << "Recieved one phase request id " << res.requestId << endl;
+        
+        forgetOnePhaseBelow(res.lowWater);
+        
+        map<int, OnePhaseOutcome>::iterator it = onePhaseOutcomes.find(res.requestId);
+        if (it != onePhaseOutcomes.end() && it->second.record == -1 && res.record >= 0)
         {
-            lines = readFile(outputName);
+            // Finished by replay, this is the resend it was waiting for
+            rememberOnePhase(res.requestId, res.record, it->second.vote);
+            it = onePhaseOutcomes.find(res.requestId);
         }
-        else
+        
+        if (it != onePhaseOutcomes.end() && it->second.record == res.record)
         {
-            lines = readFile(configFile);
+            // A resend from a coordinator that missed the outcome
+            vector<int> requestIds(1, res.requestId);
+            resendVotes(MSG_VOTE, requestIds, it->second.vote);
+            return true;
         }
         
-        for (int i = 0;i < lines.size();i ++)
+        if (resolving.count(res.requestId))
         {
-            if (system_status == NORMAL && i == 0)
-            {
-                string address = lines[0];
-                myAddress = address.erase(address.length() - 1, 1);
-                i++;
-            }
-            
-            vector<string> values = split(lines[i], ' ');
-            bookingData.push_back(stoi(values[1]));
+            return false;
         }
+        resolving.insert(res.requestId);
+        
+        ShardJob * job = createJob(JOB_ONE_PHASE, MSG_VOTE);
+        job->requests.push_back(res);
+        job->votes.push_back(VOTE_YES);
+        dispatchJob(job);
+        
+        return true;
     }
     
-    VoteStatus checkRequest(Response r)
+    bool processActionRequest(Response & res)
     {
-        for (int i = 0;i < r.dates.size();i ++)
+        cout << "Recieved commit id " << res.requestId << endl;
+        
+        if (resolving.count(res.requestId))
+        {
+            return false;
+        }
+        
+        map<int, Response>::iterator it = commitStorage.find(res.requestId);
+        if (it == commitStorage.end())
         {
-            int ticketsAvail = bookingData[r.dates[i]];
-            if (ticketsAvail < r.tickets)
+            // Already resolved or voted no, nothing to log
+            if (res.ackRequired)
             {
-                return VOTE_NO;
+                PendingReply reply;
+                reply.lsn = 0;
+                reply.startedAt = 0;
+                reply.type = MSG_ACK;
+                reply.requestIds.push_back(res.requestId);
+                deferReply(reply);
             }
+            return true;
         }
         
-        return VOTE_YES;
+        resolving.insert(res.requestId);
+        
+        // Commit turns the reservations into sales, rollback gives them back
+        ShardJob * job = createJob(res.action == COMMIT ? JOB_COMMIT : JOB_ABORT, MSG_ACK);
+        job->replyRequired = res.ackRequired;
+        job->requests.push_back(it->second);
+        dispatchJob(job);
+        
+        return true;
     }
     
-    void outputBookingData()
+    // Start waiting on a prepared request's decision. Callers hold stateLock.
+    void armDecisionTimer(Response & req)
     {
-        string port = split(myAddress, ':')[1];
-        outputName = "storage-hotel.txt";
-        if (port == "6002")
-        {
-            outputName = "storage-concert.txt";
-        }
-        outputFile.open (outputName, ios::trunc);
-        for (int i = 0;i < bookingData.size();i ++)
+        DecisionTimer timer;
+        timer.requestId = req.requestId;
+        timer.sequence = ++ timerSequence;
+        req.decisionTimer = timer.sequence;
+        decisionTimers.schedule(timer, TimerWheel<DecisionTimer>::now() + decisionTimeout);
+    }
+    
+    // Ask about every request still prepared after recovery, when their
+    // decisions may have been lost
+    void inquirePrepared()
+    {
+        pthread_mutex_lock(&stateLock);
+        for (map<int, Response>::iterator it = commitStorage.begin();it != commitStorage.end();it ++)
         {
-            outputFile << (i + 1) << " " << bookingData[i] << endl;
+            comm->sendInquiry(it->first);
+            armDecisionTimer(it->second);
         }
-        outputFile.close();
+        pthread_mutex_unlock(&stateLock);
     }
     
-    void performAction(ActionType action)
+    // Ask about each prepared request whose decision is overdue, and return
+    // how long to wait for the next one to be
+    int checkDecisionTimers()
     {
-        if (action == COMMIT)
+        pthread_mutex_lock(&stateLock);
+        
+        uint64_t now = TimerWheel<DecisionTimer>::now();
+        vector<DecisionTimer> expired;
+        decisionTimers.advance(now, expired);
+        
+        for (int i = 0;i < expired.size();i ++)
         {
-            for (int i = 0;i < commitStorage.dates.size();i ++)
+            map<int, Response>::iterator it = commitStorage.find(expired[i].requestId);
+            if (it != commitStorage.end() && it->second.decisionTimer == expired[i].sequence)
             {
-                bookingData[commitStorage.dates[i] - 1] -= commitStorage.tickets;
+                metrics.decisionTimeouts.fetch_add(1, memory_order_relaxed);
+                comm->sendInquiry(it->first);
+                armDecisionTimer(it->second);
             }
-            outputBookingData();
-        }
-        else
-        {
-            commitStorage = Response();
         }
-    }
-    
-    bool processRequest(Response res)
-    {
-        cout << "Recieved request id " << res.requestId << endl;
+        metrics.prepared.store(commitStorage.size(), memory_order_relaxed);
         
-        VoteStatus vote = checkRequest(res);
-        commitStorage = res;
-        comm->sendVote(vote, res.requestId);
+        // A timer armed by a shard after this still comes due no sooner
+        // than a full timeout from now
+        uint64_t next = decisionTimers.nextExpiry();
+        pthread_mutex_unlock(&stateLock);
         
-        return true;
+        return (next == 0 ? decisionTimeout : (int)(next - now));
     }
     
-    bool processActionRequest(Response res)
+    // Flush the log, leave a readable copy of the inventory and exit
+    void finishSystem()
     {
-        cout << "Recieved commit id " << res.requestId << endl;
+        cout << "Finished packet recieved" << endl;
         
-        performAction(res.action);
-        comm->sendAck(res.requestId);
+        pthread_mutex_lock(&stateLock);
+        waitForJobs();
+        pthread_mutex_unlock(&stateLock);
         
-        cout << "2PC for id " << res.requestId << " complete." << endl;
+        system_status = FINISHED;
         
-        return true;
+        stopCheckpoints();
+        stopShards();
+        wal->close(true);
+        outputBookingData();
+        bookingData.sync();
+        bookingData.close();
+        logfile.close();
+        
+        comm->stopSubstrate();
+        exit(0);
     }
     
     // Start the 2PC process
     bool twoPhaseCommit()
     {
-        Response res = comm->waitForResponse();
+        int timeout = checkDecisionTimers();
+        Response res = comm->waitForResponse(timeout);
+        
+        if (res.finish)
+        {
+            finishSystem();
+        }
         
         if (res.requestId == 0)
         {
             return false;
         }
         
-        sleep(1);
+        bool status;
+        pthread_mutex_lock(&stateLock);
+        while (checkpointWaiting)
+        {
+            pthread_cond_wait(&jobsDone, &stateLock);
+        }
         
-        if (res.isRequest)
+        if (res.isBatch)
+        {
+            status = processBatchRequest(res);
+        }
+        else if (res.onePhase)
+        {
+            status = processOnePhaseRequest(res);
+        }
+        else if (res.isRequest)
         {
-            return processRequest(res);
+            status = processRequest(res);
         }
         else
         {
-            return processActionRequest(res);
+            status = processActionRequest(res);
         }
+        pthread_mutex_unlock(&stateLock);
+        
+        return status;
     }
     
     // Function to start thread B
@@ -572,12 +4295,81 @@ private:
         pthread_exit(NULL);
     }
     
+    // Function to start the stats thread
+    static void * statsThreadCaller(void * context)
+    {
+        return ((Participant *)context)->waitForStatsSignal(NULL);
+    }
+    
+    // Threaded function that prints the stats each time SIGUSR1 arrives.
+    // Every other thread blocks the signal, so it is only taken here.
+    void * waitForStatsSignal(void *)
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        
+        int signal;
+        while (sigwait(&signals, &signal) == 0)
+        {
+            printStats();
+        }
+        
+        pthread_exit(NULL);
+    }
+    
+    // Called by the metrics server for each scrape
+    static string metricsCaller(void * context)
+    {
+        return ((Participant *)context)->renderMetrics();
+    }
+    
+    // The metrics in Prometheus text format, times in seconds
+    string renderMetrics()
+    {
+        ostringstream text;
+        text << "# TYPE participant_votes_total counter\n";
+        text << "participant_votes_total{vote=\"yes\"} " << metrics.yesVotes << "\n";
+        text << "participant_votes_total{vote=\"no\"} " << metrics.noVotes << "\n";
+        text << "participant_votes_total{vote=\"read_only\"} " << metrics.readOnlyVotes << "\n";
+        text << "# TYPE participant_transactions_total counter\n";
+        text << "participant_transactions_total{outcome=\"commit\"} " << metrics.commits << "\n";
+        text << "participant_transactions_total{outcome=\"one_phase_commit\"} " << metrics.onePhaseCommits << "\n";
+        text << "participant_transactions_total{outcome=\"abort\"} " << metrics.aborts << "\n";
+        text << "# TYPE participant_prepared_transactions gauge\n";
+        text << "participant_prepared_transactions " << metrics.prepared << "\n";
+        text << "# TYPE participant_decision_timeouts_total counter\n";
+        text << "participant_decision_timeouts_total " << metrics.decisionTimeouts << "\n";
+        
+        text << "# TYPE participant_prepare_service_seconds histogram\n";
+        text << metrics.prepareTime.prometheus("participant_prepare_service_seconds", "");
+        text << "# TYPE participant_decision_service_seconds histogram\n";
+        text << metrics.decisionTime.prometheus("participant_decision_service_seconds", "");
+        text << "# TYPE participant_log_flush_seconds histogram\n";
+        text << metrics.wal.flushTime.prometheus("participant_log_flush_seconds", "");
+        
+        text << "# TYPE participant_queue_depth gauge\n";
+        text << "participant_queue_depth{queue=\"input\"} " << comm->inputQueued() << "\n";
+        text << "participant_queue_depth{queue=\"output\"} " << comm->outputQueued() << "\n";
+        text << "participant_queue_depth{queue=\"response\"} " << comm->responsesQueued() << "\n";
+        text << "participant_queue_depth{queue=\"shard\"} " << metrics.shardTasks << "\n";
+        text << "participant_queue_depth{queue=\"awaiting_log\"} " << metrics.pendingReplies << "\n";
+        text << "# TYPE participant_sent_bytes_total counter\n";
+        text << "participant_sent_bytes_total " << comm->getBytesSent() << "\n";
+        text << "# TYPE participant_received_bytes_total counter\n";
+        text << "participant_received_bytes_total " << comm->getBytesRecieved() << "\n";
+        return text.str();
+    }
+    
     void initParticipant(string configFilename)
     {
         configFile = configFilename;
         
         cout << "Parsing config file..." << endl;
         readConfigFile();
+        openInventory();
+        openLog();
+        startShards();
         cout << "Participant initialization complete." << endl;
         
         logfile.open ("log.txt", ios::trunc);
@@ -595,6 +4387,15 @@ public:
     // Constructor
     Participant(string configFilename)
     {
+        pthread_mutex_init(&replyLock, NULL);
+        pthread_mutex_init(&stateLock, NULL);
+        pthread_cond_init(&jobsDone, NULL);
+        pthread_mutex_init(&checkpointLock, NULL);
+        pthread_condattr_t attributes;
+        pthread_condattr_init(&attributes);
+        pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+        pthread_cond_init(&checkpointSignal, &attributes);
+        pthread_condattr_destroy(&attributes);
         initParticipant(configFilename);
     }
     
@@ -611,11 +4412,65 @@ public:
         cout << "Participant started." << endl;
     }
     
+    void startStatsThread()
+    {
+        if (int s = pthread_create(&statsThread, NULL, &Participant::statsThreadCaller, this))
+        {
+            cout << "Error creating stats thread. Code - " << s << endl;
+            exit(1);
+        }
+        pthread_detach(statsThread);
+    }
+    
+    void startMetricsServer()
+    {
+        if (metricsPort > 0 || !metricsSocket.empty())
+        {
+            metricsServer = new MetricsServer(metricsPort, metricsSocket, &Participant::metricsCaller, this);
+        }
+    }
+    
+    // Counters, queue depths and latency percentiles in microseconds. Only
+    // reads the metrics, so the shards and log keep running meanwhile.
+    void printStats()
+    {
+        ostringstream stats;
+        stats << "Stats:" << endl;
+        stats << "  votes yes " << metrics.yesVotes << " no " << metrics.noVotes << " read only " << metrics.readOnlyVotes << endl;
+        stats << "  commits " << metrics.commits << " one phase " << metrics.onePhaseCommits << " aborts " << metrics.aborts << " prepared " << metrics.prepared << endl;
+        stats << "  prepare service time " << metrics.prepareTime.summary() << endl;
+        stats << "  decision service time " << metrics.decisionTime.summary() << endl;
+        stats << "  log flush " << metrics.wal.flushTime.summary() << endl;
+        stats << "  log records per flush " << metrics.wal.flushRecords.summary() << endl;
+        stats << "  decision timeouts " << metrics.decisionTimeouts << endl;
+        stats << "  queues input " << comm->inputQueued() << " output " << comm->outputQueued() << " responses " << comm->responsesQueued()
+              << " shard tasks " << metrics.shardTasks << " replies awaiting log " << metrics.pendingReplies << endl;
+        
+        cout << stats.str() << flush;
+    }
+    
     void failSystem()
     {
         system_status = FAILED;
-        bookingData = vector<int>();
-        commitStorage = Response();
+        comm->wake();
+        pthread_join(processThread, NULL);
+        
+        // Anything not yet flushed is lost, as in a real crash
+        stopCheckpoints();
+        stopShards();
+        wal->close(false);
+        delete wal;
+        pendingReplies.clear();
+        metrics.shardTasks = 0;
+        metrics.pendingReplies = 0;
+        metrics.prepared = 0;
+        
+        bookingData.close();
+        commitStorage.clear();
+        decisionTimers.clear();
+        onePhaseOutcomes.clear();
+        onePhaseByRecord.clear();
+        lastCommittedId = 0;
         
         comm->failSystem();
         
@@ -640,6 +4495,7 @@ public:
         outputFile << "System Recovered" << endl;
         
         startServer();
+        inquirePrepared();
     }
     
     void startFailureSimulation()
@@ -658,6 +4514,10 @@ public:
                 cout << "Starting recovery..." << endl;
                 recoverSystem();
             }
+            else if (command == "stats")
+            {
+                printStats();
+            }
         }
     }
 };
@@ -675,7 +4535,15 @@ int main(int argc, const char * argv[])
     
     signal(SIGPIPE, SIG_IGN);
     
+    // Blocked before any thread starts, so only the stats thread takes it
+    sigset_t statsSignal;
+    sigemptyset(&statsSignal);
+    sigaddset(&statsSignal, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &statsSignal, NULL);
+    
     Participant * coor = new Participant(configFile);
+    coor->startStatsThread();
+    coor->startMetricsServer();
     coor->startServer();
     coor->startFailureSimulation();
     